@@ -0,0 +1,313 @@
+#include "bitmap.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Number of 64-bit words needed to hold a given number of bits.
+ */
+size_t bitmap_word_count(size_t bit_count) {
+    return (bit_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/**
+ * Initialize a bitmap with every slot free.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - words: storage for bitmap_word_count(bit_count) words
+ *   - bit_count: number of slots
+ *
+ * The bits of the last word past bit_count are marked as taken, so they are
+ * never handed out.
+ */
+void bitmap_init(bitmap_t *bitmap, _Atomic uint64_t *words, size_t bit_count) {
+    bitmap->words = words;
+    bitmap->bit_count = bit_count;
+    bitmap->word_count = bitmap_word_count(bit_count);
+    atomic_init(&bitmap->hint, 0);
+
+    for (size_t i = 0; i < bitmap->word_count; i++) {
+        atomic_init(&words[i], 0);
+    }
+
+    size_t tail_bits = bit_count % BITMAP_WORD_BITS;
+    if (tail_bits != 0) {
+        atomic_init(&words[bitmap->word_count - 1], ~UINT64_C(0) << tail_bits);
+    }
+}
+
+/**
+ * Use words that already hold a bitmap (initialized with bitmap_init, e.g. in
+ * a mounted image) without changing them.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - words: bitmap_word_count(bit_count) words holding the bitmap
+ *   - bit_count: number of slots
+ */
+void bitmap_attach(bitmap_t *bitmap, _Atomic uint64_t *words,
+                   size_t bit_count) {
+    bitmap->words = words;
+    bitmap->bit_count = bit_count;
+    bitmap->word_count = bitmap_word_count(bit_count);
+    atomic_init(&bitmap->hint, 0);
+}
+
+/**
+ * Claim a free slot.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - scan: if not NULL, set to the words looked at (so that callers can
+ *     account for the cost of the search)
+ *
+ * Returns the index of the claimed slot, or -1 if every slot is taken.
+ */
+ssize_t bitmap_alloc(bitmap_t *bitmap, bitmap_scan_t *scan) {
+    size_t start = atomic_load_explicit(&bitmap->hint, memory_order_relaxed);
+    if (start >= bitmap->word_count) {
+        start = 0;
+    }
+
+    for (size_t n = 0; n < bitmap->word_count; n++) {
+        size_t w = start + n;
+        if (w >= bitmap->word_count) {
+            w -= bitmap->word_count;
+        }
+
+        _Atomic uint64_t *word = &bitmap->words[w];
+        uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+        while (~value != 0) {
+            int bit = __builtin_ctzll(~value);
+            uint64_t taken = value | (UINT64_C(1) << bit);
+            // on failure, value is reloaded and the search resumes in it
+            if (atomic_compare_exchange_weak_explicit(word, &value, taken,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed)) {
+                atomic_store_explicit(&bitmap->hint, w, memory_order_relaxed);
+                if (scan != NULL) {
+                    scan->first = start;
+                    scan->count = n + 1;
+                }
+                return (ssize_t)(w * BITMAP_WORD_BITS + (size_t)bit);
+            }
+        }
+    }
+
+    if (scan != NULL) {
+        scan->first = start;
+        scan->count = bitmap->word_count;
+    }
+    return -1;
+}
+
+/**
+ * Claim a slot that is free and not taken in another bitmap of the same size
+ * (e.g. to reserve slots that the other bitmap has not handed out yet).
+ *
+ * A slot must only be taken in the other bitmap by whoever holds it claimed
+ * in this one, and released in this one only after that: a claim that races
+ * with it is then undone.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - taken: the other bitmap
+ *   - scan: if not NULL, set to the words looked at
+ *
+ * Returns the index of the claimed slot, or -1 if every slot is taken in one
+ * of the bitmaps.
+ */
+ssize_t bitmap_alloc_excluding(bitmap_t *bitmap, bitmap_t const *taken,
+                               bitmap_scan_t *scan) {
+    size_t start = atomic_load_explicit(&bitmap->hint, memory_order_relaxed);
+    if (start >= bitmap->word_count) {
+        start = 0;
+    }
+
+    for (size_t n = 0; n < bitmap->word_count; n++) {
+        size_t w = start + n;
+        if (w >= bitmap->word_count) {
+            w -= bitmap->word_count;
+        }
+
+        _Atomic uint64_t *word = &bitmap->words[w];
+        _Atomic uint64_t *taken_word = &taken->words[w];
+        uint64_t value = atomic_load(word);
+        for (;;) {
+            uint64_t busy = value | atomic_load(taken_word);
+            if (~busy == 0) {
+                break;
+            }
+            uint64_t mask = UINT64_C(1) << __builtin_ctzll(~busy);
+            // on failure, value is reloaded and the search resumes in it
+            if (!atomic_compare_exchange_weak(word, &value, value | mask)) {
+                continue;
+            }
+
+            // the slot may have been handed out (and its claim released)
+            // since taken_word was loaded
+            if ((atomic_load(taken_word) & mask) == 0) {
+                atomic_store_explicit(&bitmap->hint, w, memory_order_relaxed);
+                if (scan != NULL) {
+                    scan->first = start;
+                    scan->count = n + 1;
+                }
+                return (ssize_t)(w * BITMAP_WORD_BITS +
+                                 (size_t)__builtin_ctzll(mask));
+            }
+            value = atomic_fetch_and(word, ~mask) & ~mask;
+        }
+    }
+
+    if (scan != NULL) {
+        scan->first = start;
+        scan->count = bitmap->word_count;
+    }
+    return -1;
+}
+
+/**
+ * Claim the free slots at the start of a word, up to a given number of them.
+ *
+ * Returns the number of slots claimed (0 if the first one is taken).
+ */
+static size_t claim_prefix(_Atomic uint64_t *word, size_t max) {
+    uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+    for (;;) {
+        size_t free_bits =
+            value == 0 ? BITMAP_WORD_BITS : (size_t)__builtin_ctzll(value);
+        if (free_bits > max) {
+            free_bits = max;
+        }
+        if (free_bits == 0) {
+            return 0;
+        }
+
+        uint64_t mask = free_bits == BITMAP_WORD_BITS
+                            ? ~UINT64_C(0)
+                            : (UINT64_C(1) << free_bits) - 1;
+        if (atomic_compare_exchange_weak_explicit(word, &value, value | mask,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed)) {
+            return free_bits;
+        }
+    }
+}
+
+/**
+ * Claim a run of consecutive free slots: the first free slot found (searching
+ * as bitmap_alloc does) and the free slots right after it, up to a given
+ * number of them.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - max: most slots to claim (at least 1)
+ *   - count: set to the number of slots claimed
+ *   - scan: if not NULL, set to the words looked at
+ *
+ * Returns the index of the first slot claimed, or -1 if every slot is taken.
+ */
+ssize_t bitmap_alloc_run(bitmap_t *bitmap, size_t max, size_t *count,
+                         bitmap_scan_t *scan) {
+    size_t start = atomic_load_explicit(&bitmap->hint, memory_order_relaxed);
+    if (start >= bitmap->word_count) {
+        start = 0;
+    }
+
+    for (size_t n = 0; n < bitmap->word_count; n++) {
+        size_t w = start + n;
+        if (w >= bitmap->word_count) {
+            w -= bitmap->word_count;
+        }
+
+        _Atomic uint64_t *word = &bitmap->words[w];
+        uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+        while (~value != 0) {
+            size_t bit = (size_t)__builtin_ctzll(~value);
+            uint64_t rest = value >> bit; // free slots from bit on are 0s
+            size_t len = rest == 0 ? BITMAP_WORD_BITS - bit
+                                   : (size_t)__builtin_ctzll(rest);
+            if (len > max) {
+                len = max;
+            }
+            uint64_t mask = len == BITMAP_WORD_BITS
+                                ? ~UINT64_C(0)
+                                : ((UINT64_C(1) << len) - 1) << bit;
+            // on failure, value is reloaded and the search resumes in it
+            if (!atomic_compare_exchange_weak_explicit(
+                    word, &value, value | mask, memory_order_acquire,
+                    memory_order_relaxed)) {
+                continue;
+            }
+
+            // the run may go on at the start of the following words
+            size_t first = w * BITMAP_WORD_BITS + bit;
+            size_t claimed = len;
+            size_t scanned = n + 1;
+            while (claimed < max && (first + claimed) % BITMAP_WORD_BITS == 0 &&
+                   (first + claimed) / BITMAP_WORD_BITS < bitmap->word_count) {
+                size_t more = claim_prefix(
+                    &bitmap->words[(first + claimed) / BITMAP_WORD_BITS],
+                    max - claimed);
+                scanned++;
+                claimed += more;
+                if (more < BITMAP_WORD_BITS) {
+                    break;
+                }
+            }
+
+            atomic_store_explicit(&bitmap->hint,
+                                  (first + claimed - 1) / BITMAP_WORD_BITS,
+                                  memory_order_relaxed);
+            *count = claimed;
+            if (scan != NULL) {
+                scan->first = start;
+                scan->count = scanned;
+            }
+            return (ssize_t)first;
+        }
+    }
+
+    *count = 0;
+    if (scan != NULL) {
+        scan->first = start;
+        scan->count = bitmap->word_count;
+    }
+    return -1;
+}
+
+/**
+ * Take a given slot.
+ *
+ * Returns true if the slot was free, false if it was already taken.
+ */
+bool bitmap_set(bitmap_t *bitmap, size_t bit) {
+    uint64_t mask = UINT64_C(1) << (bit % BITMAP_WORD_BITS);
+    uint64_t old = atomic_fetch_or_explicit(
+        &bitmap->words[bit / BITMAP_WORD_BITS], mask, memory_order_acquire);
+    return (old & mask) == 0;
+}
+
+/**
+ * Release a slot.
+ *
+ * Returns true if the slot was taken, false if it was already free.
+ */
+bool bitmap_free(bitmap_t *bitmap, size_t bit) {
+    uint64_t mask = UINT64_C(1) << (bit % BITMAP_WORD_BITS);
+    uint64_t old = atomic_fetch_and_explicit(
+        &bitmap->words[bit / BITMAP_WORD_BITS], ~mask, memory_order_release);
+    return (old & mask) != 0;
+}
+
+/**
+ * Check whether a slot is taken.
+ */
+bool bitmap_test(bitmap_t const *bitmap, size_t bit) {
+    uint64_t mask = UINT64_C(1) << (bit % BITMAP_WORD_BITS);
+    uint64_t value = atomic_load_explicit(
+        &bitmap->words[bit / BITMAP_WORD_BITS], memory_order_acquire);
+    return (value & mask) != 0;
+}
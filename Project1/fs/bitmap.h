@@ -0,0 +1,50 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BITMAP_WORD_BITS (64)
+
+/**
+ * Allocation bitmap (one bit per slot, set when the slot is taken).
+ *
+ * Slots are claimed with a compare-and-swap on the 64-bit word that holds
+ * them, so no lock is needed. Searches start at a rotating hint (next fit),
+ * so they usually find a free slot in the first word they look at.
+ */
+typedef struct {
+    _Atomic uint64_t *words;
+    size_t bit_count;
+    size_t word_count;
+    atomic_size_t hint; // word where the next search starts
+} bitmap_t;
+
+/**
+ * Words looked at by a search: count of them, from first on (wrapping around
+ * to the start of the bitmap past its last word).
+ */
+typedef struct {
+    size_t first;
+    size_t count;
+} bitmap_scan_t;
+
+size_t bitmap_word_count(size_t bit_count);
+
+void bitmap_init(bitmap_t *bitmap, _Atomic uint64_t *words, size_t bit_count);
+void bitmap_attach(bitmap_t *bitmap, _Atomic uint64_t *words,
+                   size_t bit_count);
+
+ssize_t bitmap_alloc(bitmap_t *bitmap, bitmap_scan_t *scan);
+ssize_t bitmap_alloc_run(bitmap_t *bitmap, size_t max, size_t *count,
+                         bitmap_scan_t *scan);
+ssize_t bitmap_alloc_excluding(bitmap_t *bitmap, bitmap_t const *taken,
+                               bitmap_scan_t *scan);
+bool bitmap_set(bitmap_t *bitmap, size_t bit);
+bool bitmap_free(bitmap_t *bitmap, size_t bit);
+bool bitmap_test(bitmap_t const *bitmap, size_t bit);
+
+#endif // BITMAP_H
@@ -0,0 +1,169 @@
+#include "buffer_cache.h"
+#include "locks.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Buffer cache: the set of inodes and blocks (each named by a key) that are
+ * held in primary memory, so that accessing them does not go to the
+ * (emulated) secondary storage. The contents themselves always live in the
+ * image; the cache only decides which accesses pay the storage latency.
+ *
+ * A fixed number of frames is managed with the CLOCK policy: every hit sets
+ * the frame's referenced bit, and a miss sweeps the clock hand over the
+ * frames, clearing referenced bits, until it finds one to evict. Lookups are
+ * lock-free; only insertions take the clock's lock.
+ */
+#define NO_KEY SIZE_MAX
+
+typedef struct {
+    _Atomic size_t key; // NO_KEY while the frame is unused
+    atomic_bool referenced;
+} frame_t;
+
+static frame_t *frames;
+static size_t frame_count;
+
+// Frame holding each key, or -1
+static atomic_int *key_frames;
+static size_t key_count;
+
+static pthread_mutex_t clock_lock;
+static size_t clock_hand;
+
+static atomic_ulong hits;
+static atomic_ulong misses;
+
+/**
+ * Initialize the buffer cache.
+ *
+ * Input:
+ *   - frame_total: number of inodes and blocks that can be cached at once (0
+ *     disables caching)
+ *   - keys: number of different keys (keys go from 0 to keys - 1)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int buffer_cache_init(size_t frame_total, size_t keys) {
+    frames = malloc(frame_total * sizeof(frame_t));
+    key_frames = malloc(keys * sizeof(atomic_int));
+    if ((frames == NULL && frame_total > 0) ||
+        (key_frames == NULL && keys > 0)) {
+        free(frames);
+        free(key_frames);
+        return -1;
+    }
+
+    frame_count = frame_total;
+    key_count = keys;
+    for (size_t i = 0; i < frame_count; i++) {
+        atomic_init(&frames[i].key, NO_KEY);
+        atomic_init(&frames[i].referenced, false);
+    }
+    for (size_t i = 0; i < key_count; i++) {
+        atomic_init(&key_frames[i], -1);
+    }
+
+    clock_hand = 0;
+    atomic_store(&hits, 0);
+    atomic_store(&misses, 0);
+    tfs_mutex_init(__FUNCTION__, &clock_lock);
+    return 0;
+}
+
+/**
+ * Destroy the buffer cache.
+ */
+void buffer_cache_destroy(void) {
+    tfs_mutex_destroy(__FUNCTION__, &clock_lock);
+    free(frames);
+    free(key_frames);
+    frames = NULL;
+    key_frames = NULL;
+    frame_count = 0;
+    key_count = 0;
+}
+
+/**
+ * Check whether a key is cached, marking its frame as referenced.
+ */
+bool buffer_cache_contains(size_t key) {
+    if (key >= key_count) {
+        return false;
+    }
+
+    int frame = atomic_load_explicit(&key_frames[key], memory_order_acquire);
+    // the frame may have been given to another key in the meantime
+    if (frame == -1 || atomic_load(&frames[frame].key) != key) {
+        return false;
+    }
+    // avoid writing to the frame when the bit is already set
+    if (!atomic_load_explicit(&frames[frame].referenced,
+                              memory_order_relaxed)) {
+        atomic_store_explicit(&frames[frame].referenced, true,
+                              memory_order_relaxed);
+    }
+    return true;
+}
+
+/**
+ * Check whether a key is cached (counting a hit or a miss).
+ *
+ * Returns true if it is; otherwise, the caller should pay the storage access
+ * and then call buffer_cache_insert.
+ */
+bool buffer_cache_lookup(size_t key) {
+    if (buffer_cache_contains(key)) {
+        atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+        return true;
+    }
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    return false;
+}
+
+/**
+ * Cache a key, evicting another one if every frame is taken.
+ */
+void buffer_cache_insert(size_t key) {
+    if (frame_count == 0 || key >= key_count) {
+        return;
+    }
+
+    tfs_mutex_lock(__FUNCTION__, &clock_lock);
+    if (atomic_load(&key_frames[key]) != -1) {
+        tfs_mutex_unlock(__FUNCTION__, &clock_lock);
+        return; // cached by a concurrent miss
+    }
+
+    // every frame gets its bit cleared in the first sweep, so this ends
+    // within two sweeps
+    frame_t *frame;
+    for (;;) {
+        frame = &frames[clock_hand];
+        clock_hand = (clock_hand + 1) % frame_count;
+        if (!atomic_exchange(&frame->referenced, false)) {
+            break;
+        }
+    }
+
+    size_t evicted = atomic_load(&frame->key);
+    if (evicted != NO_KEY) {
+        atomic_store(&key_frames[evicted], -1);
+    }
+    atomic_store(&frame->key, key);
+    atomic_store(&frame->referenced, true);
+    atomic_store_explicit(&key_frames[key], (int)(frame - frames),
+                          memory_order_release);
+    tfs_mutex_unlock(__FUNCTION__, &clock_lock);
+}
+
+/**
+ * Obtain the number of hits and misses since the cache was initialized.
+ */
+void buffer_cache_stats(unsigned long *hit_count, unsigned long *miss_count) {
+    *hit_count = atomic_load(&hits);
+    *miss_count = atomic_load(&misses);
+}
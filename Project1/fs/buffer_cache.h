@@ -0,0 +1,15 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int buffer_cache_init(size_t frame_total, size_t keys);
+void buffer_cache_destroy(void);
+
+bool buffer_cache_contains(size_t key);
+bool buffer_cache_lookup(size_t key);
+void buffer_cache_insert(size_t key);
+void buffer_cache_stats(unsigned long *hit_count, unsigned long *miss_count);
+
+#endif // BUFFER_CACHE_H
@@ -6,8 +6,61 @@
 
 #define MAX_FILE_NAME (40)
 
-#define DELAY (5000)
+// Number of direct block pointers kept in each inode
+#define INODE_DIRECT_BLOCKS (10)
 
-#define BUFFER_SIZE 200
+// Number of extents (runs of consecutive data blocks) recorded in each inode
+#define INODE_EXTENTS (4)
+
+// Bytes of data that files and symbolic links keep in their inode, until they
+// grow past them and move to a data block
+#define INODE_INLINE_SIZE (64)
+
+// Number of locks that (directory, name) pairs are hashed to
+#define NAME_LOCK_STRIPES (256)
+
+// Number of hash buckets of the dentry cache
+#define DCACHE_BUCKETS (1024)
+
+// Caches of free inumbers reserved by each thread
+#define INODE_MAGAZINE_COUNT (16)
+#define INODE_MAGAZINE_SIZE (8)
+
+// Bytes of an image reserved for the metadata journal
+#define JOURNAL_SIZE (256 * 1024)
+
+// Emulated storage accesses at least this long sleep instead of busy-waiting
+#define DEVICE_SLEEP_NS (50 * 1000)
+
+// Inodes and blocks kept in the buffer cache by default
+#define BUFFER_CACHE_SIZE (256)
+
+// Readahead of sequential reads: blocks prefetched at first, and at most
+// (while they fit in half of the buffer cache), and threads prefetching them
+#define READAHEAD_MIN_BLOCKS (4)
+#define READAHEAD_MAX_BLOCKS (32)
+#define READAHEAD_THREADS (4)
+
+// Write-back buffering of small appends: bytes buffered per file, and over
+// all files (beyond which writes go straight to the blocks), and how often
+// the flusher writes the buffers to the blocks
+#define WRITE_BUFFER_SIZE (4 * 1024)
+#define WRITE_BACK_LIMIT (1024 * 1024)
+#define WRITE_BACK_INTERVAL_MS (50)
+
+// Lock profiling (make LOCK_PROFILE=yes): call sites tracked, histogram
+// buckets (powers of 2 of nanoseconds) and locks held at once by a thread
+#define LOCK_PROFILE_SITES (256)
+#define LOCK_PROFILE_BUCKETS (32)
+#define LOCK_PROFILE_HELD (32)
+
+// Blocks handed to each writev when copying a file out of TécnicoFS
+#define EXPORT_VIEWS (64)
+
+// Most threads a worker pool is given by default (one per core otherwise)
+#define WORKER_POOL_MAX_THREADS (16)
+
+// Size of the chunks in which files that cannot be mapped are imported
+#define IMPORT_BUFFER_SIZE (64 * 1024)
 
 #endif // CONFIG_H
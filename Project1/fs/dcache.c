@@ -0,0 +1,170 @@
+#include "dcache.h"
+#include "config.h"
+#include "locks.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Dentry cache: maps the absolute path of a directory (e.g. "/tenant/box") to
+ * its inumber, so that resolving a path whose directory was resolved before
+ * skips the per-component directory lookups.
+ *
+ * Only directories are cached. Since a directory can only be removed when
+ * empty, removing it never leaves cached paths below it behind.
+ */
+typedef struct dentry {
+    struct dentry *next;
+    int inum;
+    size_t len;
+    char path[];
+} dentry_t;
+
+typedef struct {
+    pthread_rwlock_t lock;
+    dentry_t *head;
+} dcache_bucket_t;
+
+static dcache_bucket_t *buckets;
+
+// Incremented by every invalidation, to discard results of racing lookups
+static atomic_ulong generation;
+
+static dcache_bucket_t *bucket_of(char const *path, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)path[i];
+        hash *= 16777619u;
+    }
+    return &buckets[hash % DCACHE_BUCKETS];
+}
+
+static dentry_t *bucket_find(dcache_bucket_t *bucket, char const *path,
+                             size_t len) {
+    for (dentry_t *d = bucket->head; d != NULL; d = d->next) {
+        if (d->len == len && memcmp(d->path, path, len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Initialize the dentry cache.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int dcache_init(void) {
+    buckets = malloc(DCACHE_BUCKETS * sizeof(dcache_bucket_t));
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        buckets[i].head = NULL;
+        tfs_rwlock_init(__FUNCTION__, &buckets[i].lock);
+    }
+    return 0;
+}
+
+/**
+ * Destroy the dentry cache, dropping every entry.
+ */
+void dcache_destroy(void) {
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry_t *d = buckets[i].head;
+        while (d != NULL) {
+            dentry_t *next = d->next;
+            free(d);
+            d = next;
+        }
+        tfs_rwlock_destroy(__FUNCTION__, &buckets[i].lock);
+    }
+    free(buckets);
+    buckets = NULL;
+}
+
+/**
+ * Obtain the current generation, to be passed to dcache_insert once the path
+ * has been resolved.
+ */
+unsigned long dcache_generation(void) { return atomic_load(&generation); }
+
+/**
+ * Look up a directory path.
+ *
+ * Input:
+ *   - path: the path (not necessarily null-terminated)
+ *   - len: length of the path
+ *
+ * Returns the directory's inumber, or -1 if it is not cached.
+ */
+int dcache_lookup(char const *path, size_t len) {
+    dcache_bucket_t *bucket = bucket_of(path, len);
+
+    tfs_rwlock_rdlock(__FUNCTION__, &bucket->lock);
+    dentry_t *d = bucket_find(bucket, path, len);
+    int inum = d == NULL ? -1 : d->inum;
+    tfs_rwlock_unlock(__FUNCTION__, &bucket->lock);
+    return inum;
+}
+
+/**
+ * Cache the inumber of a directory path.
+ *
+ * Input:
+ *   - path: the path (not necessarily null-terminated)
+ *   - len: length of the path
+ *   - inum: the directory's inumber
+ *   - gen: value of dcache_generation() from before the path was resolved; if
+ *     anything was invalidated since then, the entry is not cached
+ */
+void dcache_insert(char const *path, size_t len, int inum, unsigned long gen) {
+    dcache_bucket_t *bucket = bucket_of(path, len);
+
+    tfs_rwlock_wrlock(__FUNCTION__, &bucket->lock);
+    if (atomic_load(&generation) != gen ||
+        bucket_find(bucket, path, len) != NULL) {
+        tfs_rwlock_unlock(__FUNCTION__, &bucket->lock);
+        return;
+    }
+
+    dentry_t *d = malloc(sizeof(dentry_t) + len);
+    if (d != NULL) { // the cache is best-effort
+        d->inum = inum;
+        d->len = len;
+        memcpy(d->path, path, len);
+        d->next = bucket->head;
+        bucket->head = d;
+    }
+    tfs_rwlock_unlock(__FUNCTION__, &bucket->lock);
+}
+
+/**
+ * Drop the entry of a directory that is being removed.
+ *
+ * Must be called after the directory's entry is cleared from its parent and
+ * before its inode is deleted.
+ */
+void dcache_invalidate(char const *path, size_t len) {
+    atomic_fetch_add(&generation, 1);
+
+    dcache_bucket_t *bucket = bucket_of(path, len);
+    tfs_rwlock_wrlock(__FUNCTION__, &bucket->lock);
+    for (dentry_t **d = &bucket->head; *d != NULL; d = &(*d)->next) {
+        if ((*d)->len == len && memcmp((*d)->path, path, len) == 0) {
+            dentry_t *removed = *d;
+            *d = removed->next;
+            free(removed);
+            break;
+        }
+    }
+    tfs_rwlock_unlock(__FUNCTION__, &bucket->lock);
+}
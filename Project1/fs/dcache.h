@@ -0,0 +1,16 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+
+int dcache_init(void);
+void dcache_destroy(void);
+
+unsigned long dcache_generation(void);
+
+int dcache_lookup(char const *path, size_t len);
+void dcache_insert(char const *path, size_t len, int inum,
+                   unsigned long generation);
+void dcache_invalidate(char const *path, size_t len);
+
+#endif // DCACHE_H
@@ -0,0 +1,177 @@
+#include "device.h"
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Emulated secondary storage: every access to persistent FS state that is not
+ * served from primary memory waits for as long as the device would take to
+ * perform it.
+ *
+ * The device has a number of channels, each serving one access at a time:
+ * an access to a busy channel starts when the accesses queued before it
+ * complete, so concurrent accesses to different channels overlap and those
+ * to the same channel serialize. Each channel only keeps the time at which
+ * its last queued access completes. The number of outstanding accesses is
+ * bounded by the queue depth, enforced with a semaphore.
+ */
+typedef struct {
+    _Atomic uint64_t busy_until; // in CLOCK_MONOTONIC nanoseconds
+    char padding[64 - sizeof(uint64_t)]; // keep channels in their own lines
+} channel_t;
+
+static tfs_device_params_t device;
+static channel_t *channels;
+static sem_t queue_slots;
+
+static atomic_ulong submitted;
+static atomic_ulong completed;
+static atomic_ulong throttled;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Wait until a given time.
+ *
+ * Short waits busy-wait (sleeping is not precise enough for them), like a
+ * thread polling for the completion of a fast device; longer ones sleep.
+ */
+static void wait_until(uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (deadline > now && deadline - now >= DEVICE_SLEEP_NS) {
+        struct timespec ts = {.tv_sec = (time_t)(deadline / 1000000000u),
+                              .tv_nsec = (long)(deadline % 1000000000u)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR) {
+        }
+        return;
+    }
+
+    while (now < deadline) {
+        now = now_ns();
+    }
+}
+
+/**
+ * Initialize the emulated device.
+ *
+ * Input:
+ *   - params: latencies, channels and queue depth of the device
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No channels, or a queue depth of 0.
+ *   - malloc failure.
+ */
+int device_init(tfs_device_params_t params) {
+    if (params.channels == 0 || params.queue_depth == 0 ||
+        params.queue_depth > SEM_VALUE_MAX) {
+        return -1;
+    }
+
+    channels = malloc(params.channels * sizeof(channel_t));
+    if (channels == NULL) {
+        return -1;
+    }
+    if (sem_init(&queue_slots, 0, (unsigned)params.queue_depth) != 0) {
+        free(channels);
+        channels = NULL;
+        return -1;
+    }
+
+    device = params;
+    for (size_t i = 0; i < device.channels; i++) {
+        atomic_init(&channels[i].busy_until, 0);
+    }
+    atomic_store(&submitted, 0);
+    atomic_store(&completed, 0);
+    atomic_store(&throttled, 0);
+    return 0;
+}
+
+/**
+ * Destroy the emulated device.
+ */
+void device_destroy(void) {
+    if (channels == NULL) {
+        return;
+    }
+    sem_destroy(&queue_slots);
+    free(channels);
+    channels = NULL;
+}
+
+/**
+ * Perform an access to the device, waiting for it to complete.
+ *
+ * Input:
+ *   - op: kind of access
+ *   - address: what is accessed (accesses are spread over the channels by
+ *     address)
+ */
+void device_access(device_op_t op, size_t address) {
+    uint64_t ns;
+    switch (op) {
+    case DEVICE_READ:
+        ns = device.read_ns;
+        break;
+    case DEVICE_WRITE:
+        ns = device.write_ns;
+        break;
+    case DEVICE_METADATA:
+        ns = device.metadata_ns;
+        break;
+    default:
+        ns = 0;
+    }
+
+    atomic_fetch_add_explicit(&submitted, 1, memory_order_relaxed);
+    if (ns == 0) {
+        atomic_fetch_add_explicit(&completed, 1, memory_order_relaxed);
+        return;
+    }
+
+    // wait for room in the queue
+    if (sem_trywait(&queue_slots) != 0) {
+        atomic_fetch_add_explicit(&throttled, 1, memory_order_relaxed);
+        while (sem_wait(&queue_slots) != 0) {
+        }
+    }
+
+    // queue the access behind those already taking the channel
+    channel_t *channel = &channels[address % device.channels];
+    uint64_t now = now_ns();
+    uint64_t busy_until = atomic_load(&channel->busy_until);
+    uint64_t done;
+    do {
+        done = (busy_until > now ? busy_until : now) + ns;
+    } while (!atomic_compare_exchange_weak(&channel->busy_until, &busy_until,
+                                           done));
+
+    wait_until(done);
+    sem_post(&queue_slots);
+    atomic_fetch_add_explicit(&completed, 1, memory_order_relaxed);
+}
+
+/**
+ * Obtain the number of accesses submitted, completed, and that had to wait
+ * for room in the queue since the device was initialized.
+ */
+void device_stats(unsigned long *submitted_count,
+                  unsigned long *completed_count,
+                  unsigned long *throttled_count) {
+    *submitted_count = atomic_load(&submitted);
+    *completed_count = atomic_load(&completed);
+    *throttled_count = atomic_load(&throttled);
+}
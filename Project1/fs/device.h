@@ -0,0 +1,19 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include "operations.h"
+
+/**
+ * Kinds of accesses to the emulated storage device.
+ */
+typedef enum { DEVICE_READ, DEVICE_WRITE, DEVICE_METADATA } device_op_t;
+
+int device_init(tfs_device_params_t params);
+void device_destroy(void);
+
+void device_access(device_op_t op, size_t address);
+void device_stats(unsigned long *submitted_count,
+                  unsigned long *completed_count,
+                  unsigned long *throttled_count);
+
+#endif // DEVICE_H
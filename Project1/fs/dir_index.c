@@ -0,0 +1,202 @@
+#include "dir_index.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DIR_INDEX_EMPTY (-1)
+#define DIR_INDEX_REMOVED (-2)
+#define DIR_INDEX_INITIAL_CAPACITY (32)
+
+/**
+ * Hash a directory entry name (32-bit FNV-1a).
+ */
+uint32_t dir_index_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static dir_index_entry_t *table_alloc(size_t capacity) {
+    dir_index_entry_t *table = malloc(capacity * sizeof(dir_index_entry_t));
+    if (table == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        table[i].slot = DIR_INDEX_EMPTY;
+    }
+    return table;
+}
+
+/**
+ * Create an empty index.
+ *
+ * Returns the index, or NULL if memory could not be allocated.
+ */
+dir_index_t *dir_index_create(void) {
+    dir_index_t *index = malloc(sizeof(dir_index_t));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    index->table = table_alloc(DIR_INDEX_INITIAL_CAPACITY);
+    if (index->table == NULL) {
+        free(index);
+        return NULL;
+    }
+    index->capacity = DIR_INDEX_INITIAL_CAPACITY;
+    index->used = 0;
+    index->count = 0;
+
+    index->free_slots = NULL;
+    index->free_count = 0;
+    index->free_capacity = 0;
+    return index;
+}
+
+void dir_index_destroy(dir_index_t *index) {
+    if (index == NULL) {
+        return;
+    }
+    free(index->table);
+    free(index->free_slots);
+    free(index);
+}
+
+/**
+ * Rebuild the table with a new capacity, dropping removed entries.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int dir_index_resize(dir_index_t *index, size_t capacity) {
+    dir_index_entry_t *table = table_alloc(capacity);
+    if (table == NULL) {
+        return -1;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < index->capacity; i++) {
+        dir_index_entry_t entry = index->table[i];
+        if (entry.slot < 0) {
+            continue;
+        }
+        size_t pos = entry.hash & (capacity - 1);
+        while (table[pos].slot != DIR_INDEX_EMPTY) {
+            pos = (pos + 1) & (capacity - 1);
+        }
+        table[pos] = entry;
+        used++;
+    }
+
+    free(index->table);
+    index->table = table;
+    index->capacity = capacity;
+    index->used = used;
+    return 0;
+}
+
+/**
+ * Record that a slot holds a name with the given hash.
+ *
+ * Returns 0 if successful, -1 if memory could not be allocated.
+ */
+int dir_index_insert(dir_index_t *index, uint32_t hash, int slot) {
+    // keep the load (including removed entries) under 3/4
+    if ((index->used + 1) * 4 > index->capacity * 3) {
+        size_t capacity = index->capacity;
+        if ((index->count + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        if (dir_index_resize(index, capacity) == -1) {
+            return -1;
+        }
+    }
+
+    size_t pos = hash & (index->capacity - 1);
+    while (index->table[pos].slot >= 0) {
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    if (index->table[pos].slot == DIR_INDEX_EMPTY) {
+        index->used++;
+    }
+    index->table[pos].hash = hash;
+    index->table[pos].slot = slot;
+    index->count++;
+    return 0;
+}
+
+/**
+ * Forget the entry for a slot (which must have been inserted with the given
+ * hash).
+ */
+void dir_index_remove(dir_index_t *index, uint32_t hash, int slot) {
+    size_t pos = hash & (index->capacity - 1);
+    while (index->table[pos].slot != DIR_INDEX_EMPTY) {
+        if (index->table[pos].slot == slot) {
+            index->table[pos].slot = DIR_INDEX_REMOVED;
+            index->count--;
+            return;
+        }
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+}
+
+/**
+ * Iterate over the slots whose names have a given hash.
+ *
+ * Input:
+ *   - index: the index
+ *   - hash: hash of the name being looked for
+ *   - cursor: iteration state, which must be set to 0 before the first call
+ *
+ * Returns the next candidate slot, or -1 when there are no more.
+ */
+int dir_index_next(dir_index_t const *index, uint32_t hash, size_t *cursor) {
+    size_t mask = index->capacity - 1;
+    for (; *cursor < index->capacity; (*cursor)++) {
+        dir_index_entry_t entry = index->table[(hash + *cursor) & mask];
+        if (entry.slot == DIR_INDEX_EMPTY) {
+            break;
+        }
+        if (entry.slot >= 0 && entry.hash == hash) {
+            (*cursor)++;
+            return entry.slot;
+        }
+    }
+    *cursor = index->capacity;
+    return -1;
+}
+
+/**
+ * Record that a slot of the directory is empty.
+ *
+ * Returns 0 if successful, -1 if memory could not be allocated.
+ */
+int dir_index_push_free(dir_index_t *index, int slot) {
+    if (index->free_count == index->free_capacity) {
+        size_t capacity =
+            index->free_capacity == 0 ? 16 : index->free_capacity * 2;
+        int *free_slots = realloc(index->free_slots, capacity * sizeof(int));
+        if (free_slots == NULL) {
+            return -1;
+        }
+        index->free_slots = free_slots;
+        index->free_capacity = capacity;
+    }
+    index->free_slots[index->free_count++] = slot;
+    return 0;
+}
+
+/**
+ * Take an empty slot of the directory.
+ *
+ * Returns the slot, or -1 if the directory has no empty slots.
+ */
+int dir_index_pop_free(dir_index_t *index) {
+    if (index->free_count == 0) {
+        return -1;
+    }
+    return index->free_slots[--index->free_count];
+}
@@ -0,0 +1,45 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * In-memory index of a directory.
+ *
+ * Maps the hash of each entry name to the slot (position in the directory's
+ * dir_entry_t array, across all of its blocks) that holds it, and keeps the
+ * list of empty slots. Names are not stored: callers confirm a candidate slot
+ * by comparing the name in the directory block.
+ *
+ * An index is not thread-safe; it is protected by the directory inode's lock.
+ */
+typedef struct {
+    uint32_t hash;
+    int slot; // DIR_INDEX_EMPTY / DIR_INDEX_REMOVED if unused
+} dir_index_entry_t;
+
+typedef struct {
+    dir_index_entry_t *table;
+    size_t capacity; // power of 2
+    size_t used;     // live and removed entries
+    size_t count;    // live entries
+
+    int *free_slots;
+    size_t free_count;
+    size_t free_capacity;
+} dir_index_t;
+
+uint32_t dir_index_hash(char const *name);
+
+dir_index_t *dir_index_create(void);
+void dir_index_destroy(dir_index_t *index);
+
+int dir_index_insert(dir_index_t *index, uint32_t hash, int slot);
+void dir_index_remove(dir_index_t *index, uint32_t hash, int slot);
+int dir_index_next(dir_index_t const *index, uint32_t hash, size_t *cursor);
+
+int dir_index_push_free(dir_index_t *index, int slot);
+int dir_index_pop_free(dir_index_t *index);
+
+#endif // DIR_INDEX_H
@@ -0,0 +1,420 @@
+#include "image.h"
+#include "bitmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_ALIGNMENT (4096)
+
+static uint64_t align_up(uint64_t offset) {
+    return (offset + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+}
+
+/**
+ * Compute where each region of an image with the given geometry goes.
+ */
+static void image_layout(tfs_params const *params, size_t inode_size,
+                         superblock_t *sb) {
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = IMAGE_MAGIC;
+    sb->version = IMAGE_VERSION;
+    sb->block_size = params->block_size;
+    sb->inode_count = params->max_inode_count;
+    sb->block_count = params->max_block_count;
+    sb->inode_size = inode_size;
+
+    sb->journal_offset = align_up(sizeof(superblock_t));
+    sb->journal_size = JOURNAL_SIZE;
+    sb->checkpoint_lsn = 1;
+    sb->free_blocks = sb->block_count;
+
+    sb->inode_bitmap_offset = align_up(sb->journal_offset + sb->journal_size);
+    sb->inode_table_offset =
+        align_up(sb->inode_bitmap_offset +
+                 bitmap_word_count(sb->inode_count) * sizeof(uint64_t));
+    sb->block_bitmap_offset =
+        align_up(sb->inode_table_offset + sb->inode_count * inode_size);
+    sb->data_offset =
+        align_up(sb->block_bitmap_offset +
+                 bitmap_word_count(sb->block_count) * sizeof(uint64_t));
+    sb->image_size = align_up(sb->data_offset +
+                              sb->block_count * sb->block_size);
+}
+
+/**
+ * Check that a superblock read from an image describes an image this build
+ * can use, of (at most) file_size bytes.
+ */
+static bool superblock_valid(superblock_t const *sb, size_t inode_size,
+                             uint64_t file_size) {
+    if (sb->magic != IMAGE_MAGIC || sb->version != IMAGE_VERSION ||
+        sb->inode_size != inode_size || sb->block_size == 0) {
+        return false;
+    }
+
+    // the offsets must be the ones this build would compute
+    tfs_params params = {
+        .max_inode_count = sb->inode_count,
+        .max_block_count = sb->block_count,
+        .block_size = sb->block_size,
+    };
+    superblock_t expected;
+    image_layout(&params, inode_size, &expected);
+    expected.checkpoint_lsn = sb->checkpoint_lsn;
+    expected.free_blocks = sb->free_blocks;
+    return memcmp(sb, &expected, sizeof(expected)) == 0 &&
+           sb->free_blocks <= sb->block_count && sb->image_size <= file_size;
+}
+
+static void image_set_regions(image_t *image) {
+    superblock_t *sb = image->base;
+    image->superblock = sb;
+    image->journal = image->base + sb->journal_offset;
+    image->inode_bitmap = image->base + sb->inode_bitmap_offset;
+    image->inode_table = image->base + sb->inode_table_offset;
+    image->block_bitmap = image->base + sb->block_bitmap_offset;
+    image->data = image->base + sb->data_offset;
+}
+
+/**
+ * Write the superblock and empty bitmaps of a new image (which is otherwise
+ * zeroed).
+ */
+static void image_format(image_t *image, superblock_t const *sb) {
+    memcpy(image->base, sb, sizeof(*sb));
+    image_set_regions(image);
+
+    bitmap_t bitmap;
+    bitmap_init(&bitmap, image->inode_bitmap, sb->inode_count);
+    image_dirty(image, image->inode_bitmap,
+                bitmap.word_count * sizeof(uint64_t));
+    bitmap_init(&bitmap, image->block_bitmap, sb->block_count);
+    image_dirty(image, image->block_bitmap,
+                bitmap.word_count * sizeof(uint64_t));
+}
+
+/**
+ * Map a file system image into memory.
+ *
+ * If path names an existing, non-empty file, the image it holds is mounted:
+ * the file is mapped as is, and its pages are only read from disk when first
+ * accessed, so mounting takes the same time whatever the size of the image.
+ * The geometry stored in the image (block size, inode and block counts)
+ * replaces the one in params.
+ *
+ * Otherwise, an empty image with the geometry in params is created, in the
+ * file (which is created if needed) or, if path is NULL, only in memory. It
+ * only reaches the file when it is first written back.
+ *
+ * Input:
+ *   - path: path of the image file in the OS' file system, or NULL
+ *   - params: TécnicoFS parameters (updated when mounting)
+ *   - inode_size: sizeof(inode_t)
+ *   - image: filled with the mapping
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The file cannot be opened, resized or mapped.
+ *   - The file does not hold a valid image.
+ *   - malloc failure (for in-memory images).
+ */
+int image_map(char const *path, tfs_params *params, size_t inode_size,
+              image_t *image) {
+    superblock_t sb;
+    image_layout(params, inode_size, &sb);
+
+    if (path == NULL) {
+        image->base = calloc(1, sb.image_size);
+        if (image->base == NULL) {
+            return -1;
+        }
+        image->size = sb.image_size;
+        image->fd = -1;
+        image->formatted = true;
+        image_format(image, &sb);
+        return 0;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    bool formatted = st.st_size == 0;
+    if (formatted) {
+        // the new file is sparse: it reads as zeros and takes no disk space
+        // until written
+        if (ftruncate(fd, (off_t)sb.image_size) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+               !superblock_valid(&sb, inode_size, (uint64_t)st.st_size)) {
+        close(fd);
+        return -1; // not an image (or made by an incompatible build)
+    }
+
+    size_t pages = sb.image_size / IMAGE_ALIGNMENT;
+    _Atomic uint64_t *dirty_words =
+        malloc(bitmap_word_count(pages) * sizeof(*dirty_words));
+    _Atomic uint64_t *data_words =
+        malloc(bitmap_word_count(sb.block_count) * sizeof(*data_words));
+    if (dirty_words == NULL || data_words == NULL) {
+        free(dirty_words);
+        free(data_words);
+        close(fd);
+        return -1;
+    }
+
+    // private, so that the kernel never writes changes back on its own
+    void *base =
+        mmap(NULL, sb.image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        free(dirty_words);
+        free(data_words);
+        close(fd);
+        return -1;
+    }
+
+    image->base = base;
+    image->size = sb.image_size;
+    image->fd = fd;
+    image->formatted = formatted;
+    bitmap_init(&image->dirty_pages, dirty_words, pages);
+    bitmap_init(&image->data_blocks, data_words, sb.block_count);
+    if (formatted) {
+        image_format(image, &sb);
+    } else {
+        image_set_regions(image);
+    }
+
+    params->block_size = sb.block_size;
+    params->max_inode_count = sb.inode_count;
+    params->max_block_count = sb.block_count;
+    return 0;
+}
+
+/**
+ * Write an image back to its file (if any) and unmap it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_unmap(image_t *image) {
+    if (image->fd == -1) {
+        free(image->base);
+        image->base = NULL;
+        return 0;
+    }
+
+    int ret = image_write_back(image);
+    if (munmap(image->base, image->size) == -1) {
+        ret = -1;
+    }
+    if (close(image->fd) == -1) {
+        ret = -1;
+    }
+    free((void *)image->dirty_pages.words);
+    free((void *)image->data_blocks.words);
+    image->base = NULL;
+    image->fd = -1;
+    return ret;
+}
+
+/**
+ * Mark part of an image as changed, to be written back to its file by the
+ * next image_write_back.
+ *
+ * Input:
+ *   - image: the image
+ *   - addr: start of the changed bytes (inside the image)
+ *   - len: number of bytes
+ */
+void image_dirty(image_t *image, void const *addr, size_t len) {
+    if (image->fd == -1 || len == 0) {
+        return;
+    }
+
+    size_t offset = (size_t)(addr - image->base);
+    size_t last = (offset + len - 1) / IMAGE_ALIGNMENT;
+    for (size_t page = offset / IMAGE_ALIGNMENT; page <= last; page++) {
+        // the page is usually dirty already: do not write to a shared line
+        if (!bitmap_test(&image->dirty_pages, page)) {
+            bitmap_set(&image->dirty_pages, page);
+        }
+    }
+}
+
+/**
+ * Mark part of the data region of an image as changed file data: besides
+ * being written back with the rest of the image, it is written by the next
+ * image_write_data.
+ *
+ * Input:
+ *   - image: the image
+ *   - addr: start of the changed bytes (inside the data region)
+ *   - len: number of bytes
+ */
+void image_dirty_data(image_t *image, void const *addr, size_t len) {
+    if (image->fd == -1 || len == 0) {
+        return;
+    }
+    image_dirty(image, addr, len);
+
+    size_t block_size = image->superblock->block_size;
+    size_t offset = (size_t)(addr - image->data);
+    size_t last = (offset + len - 1) / block_size;
+    for (size_t block = offset / block_size; block <= last; block++) {
+        if (!bitmap_test(&image->data_blocks, block)) {
+            bitmap_set(&image->data_blocks, block);
+        }
+    }
+}
+
+/**
+ * Copy bytes of the mapping to the same place in the image file.
+ */
+static int image_write(image_t *image, size_t offset, size_t len) {
+    while (len > 0) {
+        ssize_t written =
+            pwrite(image->fd, image->base + offset, len, (off_t)offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        offset += (size_t)written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Write part of an image to its file, and wait until it is on disk.
+ *
+ * Input:
+ *   - image: the image (backed by a file)
+ *   - addr: start of the bytes (inside the image)
+ *   - len: number of bytes
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_sync(image_t *image, void const *addr, size_t len) {
+    if (image_write(image, (size_t)(addr - image->base), len) == -1 ||
+        fdatasync(image->fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write the units of a region of an image that are marked in a bitmap to the
+ * image file (consecutive ones with a single write), and clear their marks.
+ *
+ * Input:
+ *   - image: the image
+ *   - marked: one bit per unit of the region
+ *   - offset: where the region starts in the image
+ *   - unit: size of each unit
+ *
+ * Returns the number of units written if successful, -1 otherwise.
+ */
+static ssize_t image_write_marked(image_t *image, bitmap_t *marked,
+                                  size_t offset, size_t unit) {
+    size_t first = 0;
+    size_t count = 0; // consecutive marked units from first on, not written yet
+    size_t written = 0;
+    int ret = 0;
+    for (size_t i = 0; i < marked->bit_count; i++) {
+        if (i % BITMAP_WORD_BITS == 0 &&
+            atomic_load(&marked->words[i / BITMAP_WORD_BITS]) == 0) {
+            i += BITMAP_WORD_BITS - 1;
+            continue;
+        }
+        if (!bitmap_free(marked, i)) {
+            continue;
+        }
+
+        if (count > 0 && first + count != i) {
+            if (image_write(image, offset + first * unit, count * unit) == -1) {
+                ret = -1;
+            }
+            written += count;
+            count = 0;
+        }
+        if (count == 0) {
+            first = i;
+        }
+        count++;
+    }
+    if (count > 0 &&
+        image_write(image, offset + first * unit, count * unit) == -1) {
+        ret = -1;
+    }
+    written += count;
+    return ret == -1 ? -1 : (ssize_t)written;
+}
+
+/**
+ * Write the file data changed since the last call (see image_dirty_data) to
+ * the image's file, and wait until it is on disk (if there was any).
+ *
+ * Only whole data blocks are written, so that metadata held in other blocks
+ * of the same pages does not reach the file. That data must not be changed
+ * meanwhile.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_write_data(image_t *image) {
+    if (image->fd == -1) {
+        return 0;
+    }
+
+    ssize_t written = image_write_marked(image, &image->data_blocks,
+                                         image->superblock->data_offset,
+                                         image->superblock->block_size);
+    if (written == -1 || (written > 0 && fdatasync(image->fd) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write every page changed since the last call (see image_dirty) to the
+ * image's file, and wait until they are on disk.
+ *
+ * Pages must not be changed meanwhile.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_write_back(image_t *image) {
+    if (image->fd == -1) {
+        return 0;
+    }
+
+    int ret = 0;
+    if (image_write_marked(image, &image->dirty_pages, 0, IMAGE_ALIGNMENT) ==
+        -1) {
+        ret = -1;
+    }
+    // the file data went with the pages holding it
+    for (size_t i = 0; i < image->data_blocks.word_count; i++) {
+        atomic_store(&image->data_blocks.words[i], 0);
+    }
+    if (fdatasync(image->fd) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,74 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "bitmap.h"
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMAGE_MAGIC (UINT64_C(0x31534663696e6354)) // "TcnicFS1"
+#define IMAGE_VERSION (5)
+
+/**
+ * Superblock, stored at the start of the image.
+ *
+ * The image is laid out as: superblock, journal, inode bitmap, inode table,
+ * block bitmap and data blocks. Offsets are in bytes from the start of the
+ * image, and each region starts at a multiple of IMAGE_ALIGNMENT.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+
+    uint64_t block_size;
+    uint64_t inode_count;
+    uint64_t block_count;
+    uint64_t inode_size; // sizeof(inode_t) of the build that created it
+
+    uint64_t journal_offset;
+    uint64_t journal_size;
+    uint64_t checkpoint_lsn; // first journal record not yet checkpointed
+    uint64_t free_blocks;    // journaled with the block bitmap
+
+    uint64_t inode_bitmap_offset;
+    uint64_t inode_table_offset;
+    uint64_t block_bitmap_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+} superblock_t;
+
+/**
+ * A mapped image, with pointers to each of its regions.
+ *
+ * The mapping of an image file is private: changes only reach the file when
+ * they are written back explicitly (image_sync, image_write_back), so that
+ * the journal decides when they do.
+ */
+typedef struct {
+    void *base;
+    size_t size;
+    int fd;         // -1 if the image only lives in memory
+    bool formatted; // true if the image was created (empty) by image_map
+    bitmap_t dirty_pages; // IMAGE_ALIGNMENT-sized pages not written back yet
+    bitmap_t data_blocks; // data blocks of file data not written since then
+
+    superblock_t *superblock;
+    void *journal;
+    void *inode_bitmap;
+    void *inode_table;
+    void *block_bitmap;
+    void *data;
+} image_t;
+
+int image_map(char const *path, tfs_params *params, size_t inode_size,
+              image_t *image);
+int image_unmap(image_t *image);
+void image_dirty(image_t *image, void const *addr, size_t len);
+void image_dirty_data(image_t *image, void const *addr, size_t len);
+int image_sync(image_t *image, void const *addr, size_t len);
+int image_write_data(image_t *image);
+int image_write_back(image_t *image);
+
+#endif // IMAGE_H
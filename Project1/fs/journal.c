@@ -0,0 +1,456 @@
+#include "journal.h"
+#include "locks.h"
+
+#include "betterassert.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Redo journal of metadata changes.
+ *
+ * Code that changes metadata in the image (inodes, bitmaps, directory entries,
+ * block pointers) calls journal_log right after each change, while it still
+ * holds whatever protects those bytes; their new contents (the after-image)
+ * are copied into the running transaction. File system operations are
+ * bracketed by journal_start/journal_stop, and join the running transaction
+ * when they start.
+ *
+ * When an operation waits for its changes to be durable, the first waiter
+ * becomes the leader: it closes the transaction, waits for the operations in
+ * it to finish, and writes it to the journal as a single record with a single
+ * sync. The other waiters sleep until it is done, so a burst of concurrent
+ * operations costs one sync. Operations that start while the transaction is
+ * being closed wait until it is, and then join a new one: the words of the
+ * bitmaps are changed without locks, and the after-images logged for them
+ * must not hold the changes of operations of another transaction.
+ *
+ * Changes reach the image file only through the journal: the image is mapped
+ * privately, and the pages changed in place are written back at checkpoints.
+ * File data is not journaled, but ordered: each commit first writes the data
+ * blocks its operations wrote, and syncs them, so that after a crash replayed
+ * metadata (sizes, block pointers, bitmaps) never points to blocks whose data
+ * did not reach the file. (The data of a transaction whose record does not
+ * make it to the journal may still reach it.)
+ * The journal region is written from its start. When a record does not fit,
+ * the image is written back instead (a checkpoint), before any other operation
+ * starts, which makes every record so far unnecessary, and the journal starts
+ * over. Mounting replays the records written since the last checkpoint.
+ */
+
+/**
+ * Header of a journal record. It is followed by length bytes of entries, each
+ * one made of a journal_entry_t and len bytes of data (padded to 8 bytes).
+ */
+typedef struct {
+    uint64_t lsn; // records are numbered consecutively across checkpoints
+    uint64_t length;
+    uint64_t checksum; // of the entries
+} journal_header_t;
+
+typedef struct {
+    uint64_t offset; // in the image
+    uint64_t len;
+} journal_entry_t;
+
+typedef struct {
+    unsigned long tid;
+    size_t handles; // operations in the transaction that have not finished
+    char *entries;
+    size_t len;
+    size_t capacity;
+    bool overflowed; // some entry could not be recorded (no memory)
+} transaction_t;
+
+static bool enabled;
+static image_t *journal_image;
+
+static pthread_mutex_t journal_lock;
+static pthread_cond_t journal_cond;
+
+// The running transaction, and the one being committed (if any)
+static transaction_t transactions[2];
+static transaction_t *running;
+static bool closing; // no more operations may join the running transaction
+static bool committing;
+static unsigned long committed_tid;
+
+// Only accessed by the leader (or at init and destroy)
+static uint64_t next_lsn;
+static size_t write_pos;
+
+static _Thread_local unsigned handle_depth;
+static _Thread_local transaction_t *handle_transaction;
+
+static size_t pad8(size_t len) { return (len + 7) & ~(size_t)7; }
+
+static uint64_t checksum(void const *data, size_t len) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= ((uint8_t const *)data)[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+/**
+ * Sync part of the image to its file.
+ */
+static void journal_sync(void const *addr, size_t len) {
+    ALWAYS_ASSERT(image_sync(journal_image, addr, len) == 0,
+                  "journal_sync: failed to sync the image");
+}
+
+/**
+ * Write the changed pages of the image back to its file, so that no journal
+ * record is needed anymore, and start the journal over.
+ *
+ * No operations may be in progress.
+ */
+static void journal_checkpoint(void) {
+    superblock_t *sb = journal_image->superblock;
+    ALWAYS_ASSERT(image_write_back(journal_image) == 0,
+                  "journal_checkpoint: failed to write the image back");
+
+    sb->checkpoint_lsn = next_lsn;
+    journal_sync(sb, sizeof(*sb));
+    write_pos = 0;
+}
+
+/**
+ * Whether a closed transaction has to be made durable by a checkpoint, rather
+ * than a journal record.
+ */
+static bool journal_needs_checkpoint(transaction_t const *transaction) {
+    size_t record_len = sizeof(journal_header_t) + transaction->len;
+    return transaction->overflowed ||
+           (transaction->len > 0 &&
+            record_len > journal_image->superblock->journal_size - write_pos);
+}
+
+/**
+ * Make a closed transaction durable, as one journal record (which must fit in
+ * the journal).
+ */
+static void journal_write(transaction_t *transaction) {
+    if (transaction->len == 0) {
+        return;
+    }
+
+    size_t record_len = sizeof(journal_header_t) + transaction->len;
+    journal_header_t header = {
+        .lsn = next_lsn++,
+        .length = transaction->len,
+        .checksum = checksum(transaction->entries, transaction->len),
+    };
+    void *record = journal_image->journal + write_pos;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), transaction->entries, transaction->len);
+    journal_sync(record, record_len);
+    write_pos += record_len;
+}
+
+/**
+ * Let operations join the other transaction (idle, since no commit is in
+ * progress).
+ *
+ * The caller must hold journal_lock.
+ */
+static void journal_open_next(void) {
+    transaction_t *transaction = running;
+    running = &transactions[transaction == &transactions[0]];
+    running->tid = transaction->tid + 1;
+    closing = false;
+    tfs_cond_broadcast(__FUNCTION__, &journal_cond);
+}
+
+/**
+ * Close the running transaction and write it, as the leader of a group commit.
+ *
+ * The caller must hold journal_lock, which is released while writing.
+ */
+static void journal_commit_running(void) {
+    transaction_t *transaction = running;
+    committing = true;
+    closing = true;
+    while (transaction->handles > 0) {
+        tfs_cond_wait(__FUNCTION__, &journal_cond, &journal_lock);
+    }
+
+    // the file data written by the transaction reaches the file before the
+    // record that refers to it, and before any operation of the next
+    // transaction changes it (as does a checkpoint, which writes back every
+    // page)
+    bool checkpoint = journal_needs_checkpoint(transaction);
+    tfs_mutex_unlock(__FUNCTION__, &journal_lock);
+    if (checkpoint) {
+        journal_checkpoint();
+    } else {
+        ALWAYS_ASSERT(image_write_data(journal_image) == 0,
+                      "journal_commit_running: failed to write file data");
+    }
+    tfs_mutex_lock(__FUNCTION__, &journal_lock);
+    journal_open_next();
+
+    if (!checkpoint) {
+        tfs_mutex_unlock(__FUNCTION__, &journal_lock);
+        journal_write(transaction);
+        tfs_mutex_lock(__FUNCTION__, &journal_lock);
+    }
+    committed_tid = transaction->tid;
+    transaction->len = 0;
+    transaction->overflowed = false;
+    committing = false;
+    tfs_cond_broadcast(__FUNCTION__, &journal_cond);
+}
+
+/**
+ * Apply the records written since the last checkpoint.
+ */
+static void journal_replay(void) {
+    superblock_t *sb = journal_image->superblock;
+    next_lsn = sb->checkpoint_lsn;
+
+    size_t pos = 0;
+    while (sb->journal_size - pos >= sizeof(journal_header_t)) {
+        journal_header_t header;
+        memcpy(&header, journal_image->journal + pos, sizeof(header));
+        void *entries = journal_image->journal + pos + sizeof(header);
+        if (header.lsn != next_lsn ||
+            header.length > sb->journal_size - pos - sizeof(header) ||
+            header.checksum != checksum(entries, header.length)) {
+            break; // end of the journal (or a torn record)
+        }
+
+        size_t done = 0;
+        while (done < header.length) {
+            journal_entry_t entry;
+            memcpy(&entry, entries + done, sizeof(entry));
+            done += sizeof(entry);
+            bool free_blocks =
+                entry.offset == offsetof(superblock_t, free_blocks) &&
+                entry.len == sizeof(sb->free_blocks);
+            ALWAYS_ASSERT((free_blocks ||
+                           entry.offset >= sb->inode_bitmap_offset) &&
+                              entry.offset <= sb->image_size &&
+                              entry.len <= sb->image_size - entry.offset &&
+                              entry.len <= header.length - done,
+                          "journal_replay: invalid journal entry");
+            memcpy(journal_image->base + entry.offset, entries + done,
+                   entry.len);
+            image_dirty(journal_image, journal_image->base + entry.offset,
+                        entry.len);
+            done += pad8(entry.len);
+        }
+
+        next_lsn++;
+        pos += sizeof(header) + header.length;
+    }
+}
+
+/**
+ * Initialize the journal of an image.
+ *
+ * If the image was mounted, the changes recorded in its journal are applied
+ * first. Images without a file (in memory only) are not journaled.
+ *
+ * Input:
+ *   - image: the mapped image
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_init(image_t *image) {
+    enabled = image->fd != -1;
+    if (!enabled) {
+        return 0;
+    }
+    journal_image = image;
+
+    if (!image->formatted) {
+        journal_replay();
+    } else {
+        next_lsn = image->superblock->checkpoint_lsn;
+    }
+    journal_checkpoint();
+
+    tfs_mutex_init(__FUNCTION__, &journal_lock);
+    tfs_cond_init(__FUNCTION__, &journal_cond);
+    memset(transactions, 0, sizeof(transactions));
+    running = &transactions[0];
+    running->tid = 1;
+    closing = false;
+    committing = false;
+    committed_tid = 0;
+    return 0;
+}
+
+/**
+ * Make every change durable and release the journal.
+ *
+ * No operations may be in progress.
+ */
+void journal_destroy(void) {
+    if (!enabled) {
+        return;
+    }
+
+    journal_checkpoint();
+    tfs_mutex_destroy(__FUNCTION__, &journal_lock);
+    tfs_cond_destroy(__FUNCTION__, &journal_cond);
+    for (size_t i = 0; i < 2; i++) {
+        free(transactions[i].entries);
+    }
+    memset(transactions, 0, sizeof(transactions));
+    enabled = false;
+}
+
+/**
+ * Begin a file system operation, joining the running transaction (once it is
+ * open to new operations). Calls may be nested (only the outermost
+ * journal_start/journal_stop pair counts).
+ *
+ * The caller must not hold any other lock.
+ */
+void journal_start(void) {
+    if (!enabled || handle_depth++ > 0) {
+        return;
+    }
+
+    tfs_mutex_lock(__FUNCTION__, &journal_lock);
+    while (closing) {
+        tfs_cond_wait(__FUNCTION__, &journal_cond, &journal_lock);
+    }
+    handle_transaction = running;
+    running->handles++;
+    tfs_mutex_unlock(__FUNCTION__, &journal_lock);
+}
+
+/**
+ * Add an entry for part of the image to the operation's transaction.
+ *
+ * The caller must hold journal_lock.
+ *
+ * Returns where the len bytes of the entry's data go, or NULL if there is no
+ * memory for it (the commit then falls back to a checkpoint).
+ */
+static char *journal_add_entry(void const *addr, size_t len) {
+    transaction_t *transaction = handle_transaction;
+
+    size_t needed = transaction->len + sizeof(journal_entry_t) + pad8(len);
+    if (needed > transaction->capacity) {
+        size_t capacity =
+            transaction->capacity == 0 ? 4096 : transaction->capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *entries = realloc(transaction->entries, capacity);
+        if (entries == NULL) {
+            transaction->overflowed = true;
+            return NULL;
+        }
+        transaction->entries = entries;
+        transaction->capacity = capacity;
+    }
+
+    journal_entry_t entry = {
+        .offset = (uint64_t)(addr - journal_image->base),
+        .len = len,
+    };
+    char *dest = transaction->entries + transaction->len;
+    memcpy(dest, &entry, sizeof(entry));
+    memset(dest + sizeof(entry) + len, 0, pad8(len) - len);
+    transaction->len = needed;
+    return dest + sizeof(entry);
+}
+
+/**
+ * Record the new contents of part of the image, which are committed with the
+ * rest of the operation's changes (and written back to the image at the next
+ * checkpoint).
+ *
+ * Must be called inside an operation.
+ *
+ * Input:
+ *   - addr: start of the changed bytes (inside the image)
+ *   - len: number of bytes
+ */
+void journal_log(void const *addr, size_t len) {
+    if (!enabled) {
+        return;
+    }
+    ALWAYS_ASSERT(handle_depth > 0, "journal_log: not inside an operation");
+    image_dirty(journal_image, addr, len);
+
+    tfs_mutex_lock(__FUNCTION__, &journal_lock);
+    char *data = journal_add_entry(addr, len);
+    if (data != NULL) {
+        memcpy(data, addr, len);
+    }
+    tfs_mutex_unlock(__FUNCTION__, &journal_lock);
+}
+
+/**
+ * Record the new value of a word of the image that is changed atomically,
+ * without locks (a bitmap word).
+ *
+ * It is read while holding journal_lock, so the entries logged for a word
+ * hold its values in the order they were taken.
+ *
+ * Must be called inside an operation.
+ *
+ * Input:
+ *   - word: the changed word (inside the image)
+ */
+void journal_log_word(_Atomic uint64_t const *word) {
+    if (!enabled) {
+        return;
+    }
+    ALWAYS_ASSERT(handle_depth > 0,
+                  "journal_log_word: not inside an operation");
+    image_dirty(journal_image, (void const *)word, sizeof(*word));
+
+    tfs_mutex_lock(__FUNCTION__, &journal_lock);
+    char *data = journal_add_entry((void const *)word, sizeof(*word));
+    if (data != NULL) {
+        uint64_t value = atomic_load(word);
+        memcpy(data, &value, sizeof(value));
+    }
+    tfs_mutex_unlock(__FUNCTION__, &journal_lock);
+}
+
+/**
+ * End a file system operation.
+ *
+ * Input:
+ *   - wait: whether to wait until the operation's changes are durable
+ */
+void journal_stop(bool wait) {
+    if (!enabled || --handle_depth > 0) {
+        return;
+    }
+
+    transaction_t *transaction = handle_transaction;
+    handle_transaction = NULL;
+
+    tfs_mutex_lock(__FUNCTION__, &journal_lock);
+    unsigned long tid = transaction->tid;
+    if (--transaction->handles == 0) {
+        tfs_cond_broadcast(__FUNCTION__, &journal_cond);
+    }
+
+    // a transaction nobody waits for is committed once it grows large
+    if (!wait && !committing && running == transaction &&
+        transaction->len >= journal_image->superblock->journal_size / 2) {
+        journal_commit_running();
+    }
+
+    while (wait && committed_tid < tid) {
+        if (!committing && running == transaction) {
+            journal_commit_running();
+        } else {
+            tfs_cond_wait(__FUNCTION__, &journal_cond, &journal_lock);
+        }
+    }
+    tfs_mutex_unlock(__FUNCTION__, &journal_lock);
+}
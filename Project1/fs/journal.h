@@ -0,0 +1,19 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "image.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+int journal_init(image_t *image);
+void journal_destroy(void);
+
+void journal_start(void);
+void journal_log(void const *addr, size_t len);
+void journal_log_word(_Atomic uint64_t const *word);
+void journal_stop(bool wait);
+
+#endif // JOURNAL_H
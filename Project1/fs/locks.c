@@ -1,61 +1,341 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include "locks.h"
+#include "config.h"
 
 #include "betterassert.h"
 
+/*
+ * Every lock of TécnicoFS is taken through these wrappers, with the name of
+ * the calling function. Built with TFS_LOCK_PROFILE (make LOCK_PROFILE=yes),
+ * they keep statistics for each caller: how many times it acquired a lock,
+ * how many of those had to wait, and histograms of the time spent waiting and
+ * holding the lock (see tfs_lock_profile_dump). Otherwise, they only check
+ * for errors.
+ */
+
+/**
+ * Abort after a failed lock operation. The message is only built here, so it
+ * costs nothing when locking succeeds.
+ */
+static void lock_failed(char const *what, char const *func_name) {
+	char error[100];
+	snprintf(error, sizeof(error), "%s in %s", what, func_name);
+	PANIC(error);
+}
+
+#ifdef TFS_LOCK_PROFILE
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Statistics of one call site. Bucket b of a histogram counts times in
+ * [2^b, 2^(b+1)) nanoseconds (bucket 0 also counts 0).
+ */
+typedef struct {
+	_Atomic(char const *) func_name; // NULL while the slot is unused
+	atomic_ulong acquires;
+	atomic_ulong contended;
+	atomic_ulong wait_hist[LOCK_PROFILE_BUCKETS];
+	atomic_ulong hold_hist[LOCK_PROFILE_BUCKETS];
+} lock_site_t;
+
+static lock_site_t sites[LOCK_PROFILE_SITES];
+
+// Locks held by the calling thread, to measure how long they are held
+typedef struct {
+	void const *lock;
+	lock_site_t *site;
+	uint64_t acquired;
+} held_lock_t;
+
+static _Thread_local held_lock_t held[LOCK_PROFILE_HELD];
+static _Thread_local size_t held_count;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t histogram_bucket(uint64_t ns) {
+	size_t bucket = 0;
+	while (ns > 1 && bucket < LOCK_PROFILE_BUCKETS - 1) {
+		ns >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/**
+ * Obtain the statistics of a call site, or NULL if there are too many sites.
+ */
+static lock_site_t *site_get(char const *func_name) {
+	uint32_t hash = 2166136261u;
+	for (char const *c = func_name; *c != '\0'; c++) {
+		hash ^= (uint8_t)*c;
+		hash *= 16777619u;
+	}
+
+	for (size_t n = 0; n < LOCK_PROFILE_SITES; n++) {
+		lock_site_t *site = &sites[(hash + n) % LOCK_PROFILE_SITES];
+		char const *name = atomic_load(&site->func_name);
+		if (name == NULL &&
+		    atomic_compare_exchange_strong(&site->func_name, &name, func_name)) {
+			return site;
+		}
+		if (strcmp(name, func_name) == 0) {
+			return site;
+		}
+	}
+	return NULL;
+}
+
+static void profile_acquired(void const *lock, char const *func_name,
+                             uint64_t start, bool waited) {
+	uint64_t now = now_ns();
+	lock_site_t *site = site_get(func_name);
+	if (site != NULL) {
+		atomic_fetch_add_explicit(&site->acquires, 1, memory_order_relaxed);
+		if (waited) {
+			atomic_fetch_add_explicit(&site->contended, 1,
+			                          memory_order_relaxed);
+		}
+		atomic_fetch_add_explicit(
+		    &site->wait_hist[histogram_bucket(now - start)], 1,
+		    memory_order_relaxed);
+	}
+
+	if (held_count < LOCK_PROFILE_HELD) {
+		held[held_count++] = (held_lock_t){lock, site, now};
+	}
+}
+
+static void profile_released(void const *lock) {
+	for (size_t i = held_count; i > 0; i--) {
+		if (held[i - 1].lock != lock) {
+			continue;
+		}
+		lock_site_t *site = held[i - 1].site;
+		if (site != NULL) {
+			atomic_fetch_add_explicit(
+			    &site->hold_hist[histogram_bucket(now_ns() - held[i - 1].acquired)],
+			    1, memory_order_relaxed);
+		}
+		memmove(&held[i - 1], &held[i], (held_count - i) * sizeof(held_lock_t));
+		held_count--;
+		return;
+	}
+}
+#endif // TFS_LOCK_PROFILE
+
 void tfs_rwlock_init(char const *func_name, pthread_rwlock_t *lock) {
-	char error[100] = "tfs_rwlock_init: failed to init in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_rwlock_init(lock, NULL) == 0, error);
+	if (pthread_rwlock_init(lock, NULL) != 0) {
+		lock_failed("tfs_rwlock_init: failed to init", func_name);
+	}
 }
 
 void tfs_rwlock_destroy(char const *func_name, pthread_rwlock_t *lock) {
-	char error[100] = "tfs_rwlock_destroy: failed to destroy in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_rwlock_destroy(lock) == 0, error);
+	if (pthread_rwlock_destroy(lock) != 0) {
+		lock_failed("tfs_rwlock_destroy: failed to destroy", func_name);
+	}
 }
 
 void tfs_rwlock_rdlock(char const *func_name, pthread_rwlock_t *lock) {
-	char error[100] = "tfs_rwlock_rdlock: failed to lock in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_rwlock_rdlock(lock) == 0, error);
+#ifdef TFS_LOCK_PROFILE
+	uint64_t start = now_ns();
+	bool waited = pthread_rwlock_tryrdlock(lock) != 0;
+	if (waited && pthread_rwlock_rdlock(lock) != 0) {
+		lock_failed("tfs_rwlock_rdlock: failed to lock", func_name);
+	}
+	profile_acquired(lock, func_name, start, waited);
+#else
+	if (pthread_rwlock_rdlock(lock) != 0) {
+		lock_failed("tfs_rwlock_rdlock: failed to lock", func_name);
+	}
+#endif
 }
 
 void tfs_rwlock_wrlock(char const *func_name, pthread_rwlock_t *lock) {
-	char error[100] = "tfs_rwlock_wrlock: failed to lock in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_rwlock_wrlock(lock) == 0, error);
+#ifdef TFS_LOCK_PROFILE
+	uint64_t start = now_ns();
+	bool waited = pthread_rwlock_trywrlock(lock) != 0;
+	if (waited && pthread_rwlock_wrlock(lock) != 0) {
+		lock_failed("tfs_rwlock_wrlock: failed to lock", func_name);
+	}
+	profile_acquired(lock, func_name, start, waited);
+#else
+	if (pthread_rwlock_wrlock(lock) != 0) {
+		lock_failed("tfs_rwlock_wrlock: failed to lock", func_name);
+	}
+#endif
 }
 
 void tfs_rwlock_unlock(char const *func_name, pthread_rwlock_t *lock) {
-	char error[100] = "tfs_rwlock_unlock: failed to unlock in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_rwlock_unlock(lock) == 0, error);
+#ifdef TFS_LOCK_PROFILE
+	profile_released(lock);
+#endif
+	if (pthread_rwlock_unlock(lock) != 0) {
+		lock_failed("tfs_rwlock_unlock: failed to unlock", func_name);
+	}
 }
 
 void tfs_mutex_init(char const *func_name, pthread_mutex_t *lock) {
-	char error[100] = "tfs_mutex_init: failed to init in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_mutex_init(lock, NULL) == 0, error);
+	if (pthread_mutex_init(lock, NULL) != 0) {
+		lock_failed("tfs_mutex_init: failed to init", func_name);
+	}
 }
 
 void tfs_mutex_destroy(char const *func_name, pthread_mutex_t *lock) {
-	char error[100] = "tfs_mutex_destroy: failed to destroy in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_mutex_destroy(lock) == 0, error);
+	if (pthread_mutex_destroy(lock) != 0) {
+		lock_failed("tfs_mutex_destroy: failed to destroy", func_name);
+	}
 }
 
 void tfs_mutex_lock(char const *func_name, pthread_mutex_t *lock) {
-	char error[100] = "tfs_mutex_lock: failed to lock in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_mutex_lock(lock) == 0, error);
+#ifdef TFS_LOCK_PROFILE
+	uint64_t start = now_ns();
+	bool waited = pthread_mutex_trylock(lock) != 0;
+	if (waited && pthread_mutex_lock(lock) != 0) {
+		lock_failed("tfs_mutex_lock: failed to lock", func_name);
+	}
+	profile_acquired(lock, func_name, start, waited);
+#else
+	if (pthread_mutex_lock(lock) != 0) {
+		lock_failed("tfs_mutex_lock: failed to lock", func_name);
+	}
+#endif
 }
 
 void tfs_mutex_unlock(char const *func_name, pthread_mutex_t *lock) {
-	char error[100] = "tfs_mutex_unlock: failed to unlock in ";
-	strcat(error, func_name);
-	ALWAYS_ASSERT(pthread_mutex_unlock(lock) == 0, error);
+#ifdef TFS_LOCK_PROFILE
+	profile_released(lock);
+#endif
+	if (pthread_mutex_unlock(lock) != 0) {
+		lock_failed("tfs_mutex_unlock: failed to unlock", func_name);
+	}
+}
+
+void tfs_cond_init(char const *func_name, pthread_cond_t *cond) {
+	if (pthread_cond_init(cond, NULL) != 0) {
+		lock_failed("tfs_cond_init: failed to init", func_name);
+	}
+}
+
+void tfs_cond_destroy(char const *func_name, pthread_cond_t *cond) {
+	if (pthread_cond_destroy(cond) != 0) {
+		lock_failed("tfs_cond_destroy: failed to destroy", func_name);
+	}
+}
+
+void tfs_cond_wait(char const *func_name, pthread_cond_t *cond,
+                   pthread_mutex_t *lock) {
+#ifdef TFS_LOCK_PROFILE
+	// the mutex is not held while waiting, and is reacquired afterwards
+	profile_released(lock);
+	uint64_t start = now_ns();
+#endif
+	if (pthread_cond_wait(cond, lock) != 0) {
+		lock_failed("tfs_cond_wait: failed to wait", func_name);
+	}
+#ifdef TFS_LOCK_PROFILE
+	profile_acquired(lock, func_name, start, false);
+#endif
+}
+
+/**
+ * Wait on a condition variable, but only until a given time.
+ *
+ * Input:
+ *   - abstime: when to stop waiting (CLOCK_REALTIME)
+ *
+ * Returns false if the time passed without a wakeup, true otherwise.
+ */
+bool tfs_cond_timedwait(char const *func_name, pthread_cond_t *cond,
+                        pthread_mutex_t *lock, struct timespec const *abstime) {
+#ifdef TFS_LOCK_PROFILE
+	profile_released(lock);
+	uint64_t start = now_ns();
+#endif
+	int err = pthread_cond_timedwait(cond, lock, abstime);
+	if (err != 0 && err != ETIMEDOUT) {
+		lock_failed("tfs_cond_timedwait: failed to wait", func_name);
+	}
+#ifdef TFS_LOCK_PROFILE
+	profile_acquired(lock, func_name, start, false);
+#endif
+	return err == 0;
+}
+
+void tfs_cond_broadcast(char const *func_name, pthread_cond_t *cond) {
+	if (pthread_cond_broadcast(cond) != 0) {
+		lock_failed("tfs_cond_broadcast: failed to broadcast", func_name);
+	}
+}
+
+void tfs_cond_signal(char const *func_name, pthread_cond_t *cond) {
+	if (pthread_cond_signal(cond) != 0) {
+		lock_failed("tfs_cond_signal: failed to signal", func_name);
+	}
+}
+
+/**
+ * Print the lock statistics of every call site.
+ *
+ * Input:
+ *   - out: where to print them
+ *
+ * Returns 0 if successful, -1 if TécnicoFS was built without lock profiling.
+ */
+int tfs_lock_profile_dump(FILE *out) {
+#ifdef TFS_LOCK_PROFILE
+	for (size_t i = 0; i < LOCK_PROFILE_SITES; i++) {
+		lock_site_t *site = &sites[i];
+		char const *name = atomic_load(&site->func_name);
+		if (name == NULL) {
+			continue;
+		}
+
+		fprintf(out, "%s: %lu acquires, %lu contended\n", name,
+		        atomic_load(&site->acquires), atomic_load(&site->contended));
+		char const *labels[] = {"wait", "hold"};
+		atomic_ulong *histograms[] = {site->wait_hist, site->hold_hist};
+		for (size_t h = 0; h < 2; h++) {
+			fprintf(out, "  %s ns:", labels[h]);
+			for (size_t b = 0; b < LOCK_PROFILE_BUCKETS; b++) {
+				unsigned long count = atomic_load(&histograms[h][b]);
+				if (count > 0) {
+					fprintf(out, " %lu+:%lu", b == 0 ? 0 : 1ul << b, count);
+				}
+			}
+			fprintf(out, "\n");
+		}
+	}
+	return 0;
+#else
+	(void)out;
+	return -1;
+#endif
+}
+
+/**
+ * Clear the lock statistics (e.g. after a warm-up phase).
+ */
+void tfs_lock_profile_reset(void) {
+#ifdef TFS_LOCK_PROFILE
+	for (size_t i = 0; i < LOCK_PROFILE_SITES; i++) {
+		lock_site_t *site = &sites[i];
+		atomic_store(&site->acquires, 0);
+		atomic_store(&site->contended, 0);
+		for (size_t b = 0; b < LOCK_PROFILE_BUCKETS; b++) {
+			atomic_store(&site->wait_hist[b], 0);
+			atomic_store(&site->hold_hist[b], 0);
+		}
+	}
+#endif
 }
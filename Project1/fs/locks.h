@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -24,5 +25,23 @@ void tfs_mutex_lock(char const *func_name, pthread_mutex_t *lock);
 
 void tfs_mutex_unlock(char const *func_name, pthread_mutex_t *lock);
 
+void tfs_cond_init(char const *func_name, pthread_cond_t *cond);
+
+void tfs_cond_destroy(char const *func_name, pthread_cond_t *cond);
+
+void tfs_cond_wait(char const *func_name, pthread_cond_t *cond,
+                   pthread_mutex_t *lock);
+
+bool tfs_cond_timedwait(char const *func_name, pthread_cond_t *cond,
+                        pthread_mutex_t *lock, struct timespec const *abstime);
+
+void tfs_cond_broadcast(char const *func_name, pthread_cond_t *cond);
+
+void tfs_cond_signal(char const *func_name, pthread_cond_t *cond);
+
+int tfs_lock_profile_dump(FILE *out);
+
+void tfs_lock_profile_reset(void);
+
 
 #endif
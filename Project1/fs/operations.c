@@ -1,17 +1,63 @@
 #include "operations.h"
 #include "config.h"
+#include "buffer_cache.h"
+#include "dcache.h"
+#include "device.h"
+#include "dir_index.h"
+#include "journal.h"
 #include "locks.h"
 #include "state.h"
+#include "worker_pool.h"
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 #include "betterassert.h"
 
-static pthread_mutex_t tfs_mutex;
+/*
+ * Namespace operations (tfs_open, tfs_sym_link, tfs_link, tfs_unlink,
+ * tfs_mkdir and tfs_rmdir) lock the names they look up or change. Each
+ * (directory inumber, name) pair maps to one of NAME_LOCK_STRIPES mutexes, so
+ * operations on different names proceed in parallel, even in the same
+ * directory, while operations on the same name are serialized.
+ *
+ * Lock order:
+ *   1. name locks, in increasing address order (tfs_link takes two);
+ *   2. open file entry locks (open_file_entry_t::lock);
+ *   3. inode locks (get_inode_lock), at most one at a time; state.c takes the
+ *      lock of a directory inode within find_in_dir, add_dir_entry,
+ *      clear_dir_entry and dir_remove_if_empty;
+ *   4. the locks internal to the open file table, the allocators, the
+ *      dentry cache, the journal, the readahead pool and the write-back
+ *      flusher, which never wait for other locks while held.
+ *
+ * Operations that change metadata run as journal handles (journal_start before
+ * taking any lock, which may wait for a commit, and journal_stop once every
+ * lock is released). Namespace operations return only once their changes are
+ * durable; writes leave theirs to the next group commit.
+ */
+static pthread_mutex_t name_locks[NAME_LOCK_STRIPES];
+
+// Threads prefetching the blocks of sequential reads (NULL if there is no
+// buffer cache to prefetch them into), and most blocks prefetched ahead
+static worker_pool_t *readahead_pool;
+static size_t readahead_max;
+
+static pthread_mutex_t *name_lock(int dir_inum, char const *sub_name) {
+    uint32_t hash =
+        dir_index_hash(sub_name) ^ ((uint32_t)dir_inum * 2654435761u);
+    return &name_locks[hash % NAME_LOCK_STRIPES];
+}
 
 tfs_params tfs_default_params() {
     tfs_params params = {
@@ -19,10 +65,46 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .buffer_cache_size = BUFFER_CACHE_SIZE,
+        .device = tfs_device_params(TFS_DEVICE_NVME),
+        .image_path = NULL,
     };
     return params;
 }
 
+tfs_device_params_t tfs_device_params(tfs_device_t device) {
+    tfs_device_params_t params = {0, 0, 0, 1, 1};
+    switch (device) {
+    case TFS_DEVICE_NONE:
+        break;
+    case TFS_DEVICE_NVME:
+        params.read_ns = 20 * 1000;
+        params.write_ns = 15 * 1000;
+        params.metadata_ns = 20 * 1000;
+        params.channels = 8;
+        params.queue_depth = 64;
+        break;
+    case TFS_DEVICE_SATA_SSD:
+        params.read_ns = 100 * 1000;
+        params.write_ns = 60 * 1000;
+        params.metadata_ns = 100 * 1000;
+        params.channels = 4;
+        params.queue_depth = 32; // NCQ
+        break;
+    case TFS_DEVICE_HDD:
+        // seek plus half a rotation at 7200 RPM, a single head at a time
+        params.read_ns = 8 * 1000 * 1000;
+        params.write_ns = 8 * 1000 * 1000;
+        params.metadata_ns = 8 * 1000 * 1000;
+        params.channels = 1;
+        params.queue_depth = 32;
+        break;
+    default:
+        PANIC("tfs_device_params: unknown device");
+    }
+    return params;
+}
+
 int tfs_init(tfs_params const *params_ptr) {
     tfs_params params;
 
@@ -36,94 +118,191 @@ int tfs_init(tfs_params const *params_ptr) {
         return -1;
     }
 
-    // create root inode
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
-    
+    // create root inode, unless an existing image was mounted
+    if (!state_mounted()) {
+        journal_start();
+        int root = inode_create(T_DIRECTORY);
+        journal_stop(true);
+        if (root != ROOT_DIR_INUM) {
+            state_destroy();
+            return -1;
+        }
+    }
+
+    if (dcache_init() != 0) {
+        state_destroy();
         return -1;
     }
 
-    tfs_mutex_init(__FUNCTION__, &tfs_mutex);
+    for (size_t i = 0; i < NAME_LOCK_STRIPES; i++) {
+        tfs_mutex_init(__FUNCTION__, &name_locks[i]);
+    }
+
+    readahead_max = params.buffer_cache_size / 2;
+    if (readahead_max > READAHEAD_MAX_BLOCKS) {
+        readahead_max = READAHEAD_MAX_BLOCKS;
+    }
+    if (readahead_max >= READAHEAD_MIN_BLOCKS) {
+        // without it, reads simply get no readahead
+        readahead_pool = worker_pool_create(READAHEAD_THREADS);
+    }
 
     return 0;
 }
 
 int tfs_destroy() {
+    // pending prefetches still go to the device and the buffer cache
+    if (readahead_pool != NULL) {
+        worker_pool_destroy(readahead_pool);
+        readahead_pool = NULL;
+    }
+
     if (state_destroy() != 0) {
         return -1;
     }
 
-    tfs_mutex_destroy(__FUNCTION__, &tfs_mutex);
+    dcache_destroy();
+    for (size_t i = 0; i < NAME_LOCK_STRIPES; i++) {
+        tfs_mutex_destroy(__FUNCTION__, &name_locks[i]);
+    }
     return 0;
 }
 
+void tfs_cache_stats(tfs_cache_stats_t *stats) {
+    buffer_cache_stats(&stats->hits, &stats->misses);
+}
+
+void tfs_device_stats(tfs_device_stats_t *stats) {
+    device_stats(&stats->submitted, &stats->completed, &stats->throttled);
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
 /**
- * Looks for a file.
+ * Looks for a directory.
+ *
+ * The directory paths resolved along the way are kept in the dentry cache, so
+ * resolving the same directory again costs a single cache lookup.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * Input:
+ *   - path: absolute path name (not necessarily null-terminated)
+ *   - len: length of the path; 0 stands for the root directory
+ * Returns the inumber of the directory, -1 if unsuccessful.
+ */
+static int tfs_lookup_dir(char const *path, size_t len) {
+    if (len == 0) {
+        return ROOT_DIR_INUM;
+    }
+
+    int inum = dcache_lookup(path, len);
+    if (inum != -1) {
+        return inum;
+    }
+
+    // walk the path from the root, one component at a time
+    unsigned long generation = dcache_generation();
+    inum = ROOT_DIR_INUM;
+    size_t start = 0; // path[start] is the '/' before the component
+    while (start < len) {
+        size_t end = start + 1;
+        while (end < len && path[end] != '/') {
+            end++;
+        }
+
+        size_t component_len = end - start - 1;
+        if (component_len == 0 || component_len > MAX_FILE_NAME - 1) {
+            return -1; // invalid component
+        }
+        char component[MAX_FILE_NAME];
+        memcpy(component, path + start + 1, component_len);
+        component[component_len] = '\0';
+
+        inum = find_in_dir(inum, component);
+        if (inum == -1 || inode_get(inum)->i_node_type != T_DIRECTORY) {
+            return -1; // missing, or not a directory
+        }
+        dcache_insert(path, end, inum, generation);
+        start = end;
+    }
+
+    return inum;
+}
+
+/**
+ * Looks for the directory that holds a file.
  *
  * Input:
  *   - name: absolute path name
- *   - inum: the root directory inum
- * Returns the inumber of the file, -1 if unsuccessful.
+ *   - sub_name: buffer with MAX_FILE_NAME bytes, where the file name (last
+ *     component of the path) is stored
+ * Returns the inumber of the directory, -1 if unsuccessful.
  */
-static int tfs_lookup(char const *name, int inum) {
-    // TODO: assert that root_inode is the root directory
+static int tfs_lookup_parent(char const *name, char *sub_name) {
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
+    char const *last = strrchr(name, '/');
+    size_t sub_name_len = strlen(last + 1);
+    if (sub_name_len == 0 || sub_name_len > MAX_FILE_NAME - 1) {
+        return -1;
+    }
+    memcpy(sub_name, last + 1, sub_name_len + 1);
 
-    return find_in_dir(inum, name);
+    return tfs_lookup_dir(name, (size_t)(last - name));
 }
 
-int tfs_open(char const *name, tfs_file_mode_t mode) {
-    // Checks if the path name is valid
-    if (!valid_pathname(name)) {
+static int open_file(char const *name, tfs_file_mode_t mode) {
+    // Checks if the path name is valid, and finds the directory that holds it
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(name, sub_name);
+    if (dir_inum == -1) {
         return -1;
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL, "tfs_open: root dir inode must exist");
-    tfs_mutex_lock(__FUNCTION__, &tfs_mutex);
+    pthread_mutex_t *lock = name_lock(dir_inum, sub_name);
+    tfs_mutex_lock(__FUNCTION__, lock);
 
-    int inum = tfs_lookup(name, ROOT_DIR_INUM);
+    int inum = find_in_dir(dir_inum, sub_name);
     size_t offset;
 
     if (inum >= 0) {
         // The file already exists
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-
         inode_t *inode = inode_get(inum);
         ALWAYS_ASSERT(inode != NULL, "tfs_open: directory files must have an inode");
 
 		if (inode->i_node_type == T_SOFTLINK) {
 			char target[FILENAME_MAX];
-			void *block = data_block_get(inode->i_data_block);
-			ALWAYS_ASSERT(block != NULL, "tfs_open: data block deleted mid-read");
+			void const *data = inode_inline_get(inode);
+			if (data == NULL) {
+				data = data_block_get(inode->i_direct[0]);
+				ALWAYS_ASSERT(data != NULL, "tfs_open: data block deleted mid-read");
+			}
 			size_t to_read = inode->i_size;
-			memcpy(target, block, to_read);
+			memcpy(target, data, to_read);
+            tfs_mutex_unlock(__FUNCTION__, lock);
 
 			return tfs_open(target, mode);
 		}
 
+        if (inode->i_node_type == T_DIRECTORY) {
+            tfs_mutex_unlock(__FUNCTION__, lock);
+            return -1; // directories cannot be opened
+        }
+
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+            tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(inum));
+            inode_truncate(inode);
+            tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
         }
         // Determine initial offset
         if (mode & TFS_O_APPEND) {
-            offset = inode->i_size;
+            tfs_rwlock_rdlock(__FUNCTION__, get_inode_lock(inum));
+            offset = inode_file_size(inode);
+            tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
         } else {
             offset = 0;
         }
@@ -132,33 +311,43 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         // Create inode
         inum = inode_create(T_FILE);
         if (inum == -1) {
-            tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
+            tfs_mutex_unlock(__FUNCTION__, lock);
             return -1; // no space in inode table
         }
 
-        // Add entry in the root directory
-        if (add_dir_entry(ROOT_DIR_INUM, name + 1, inum) == -1) {
-            tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
+        // Add entry in the directory
+        if (add_dir_entry(dir_inum, sub_name, inum) == -1) {
+            tfs_mutex_unlock(__FUNCTION__, lock);
             inode_delete(inum);
             return -1; // no space in directory
         }
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
         offset = 0;
     } else {
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
+        tfs_mutex_unlock(__FUNCTION__, lock);
         return -1;
     }
 
     // Finally, add entry to the open file table and return the corresponding
-    // handle
-    return add_to_open_file_table(inum, offset);
+    // handle (while holding the name lock, so that the file cannot be
+    // unlinked in between)
+    int fhandle =
+        add_to_open_file_table(inum, offset, (mode & TFS_O_APPEND) != 0);
+    tfs_mutex_unlock(__FUNCTION__, lock);
+    return fhandle;
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
     // opened but it remains created
 }
 
-int tfs_sym_link(char const *target, char const *link_name) {
+int tfs_open(char const *name, tfs_file_mode_t mode) {
+    journal_start();
+    int fhandle = open_file(name, mode);
+    journal_stop(true);
+    return fhandle;
+}
+
+static int create_sym_link(char const *target, char const *link_name) {
 	if (!valid_pathname(target)) {
         return -1;
     }
@@ -167,71 +356,219 @@ int tfs_sym_link(char const *target, char const *link_name) {
         return -1;
     }
 
-	inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_sym_link: root dir inode must exist");
-    tfs_mutex_lock(__FUNCTION__, &tfs_mutex);
+	// the target path is stored with its terminator in the inode, if it fits,
+	// or else in the first data block
+	size_t to_write = strlen(target) + 1;
+	if (to_write > state_block_size() || to_write > FILENAME_MAX) {
+		return -1; // target path too long
+	}
+
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(link_name, sub_name);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    pthread_mutex_t *lock = name_lock(dir_inum, sub_name);
+    tfs_mutex_lock(__FUNCTION__, lock);
+    if (find_in_dir(dir_inum, sub_name) != -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // name already taken
+    }
 
 	int inum = inode_create(T_SOFTLINK);
-    /* add the inode to directory table */
-    if (add_dir_entry(ROOT_DIR_INUM, link_name + 1, inum) == -1) {
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-		return -1; // no space in directory
+	if (inum == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+		return -1; // no space in inode table
 	}
-    tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
 
 	inode_t *inode = inode_get(inum);
-	if (inum == -1) {
-		return -1; // no space in inode table
+	if (inode_inline_write(inode, target, to_write, 0) == -1) {
+		inode_inline_spill(inode); // nothing to move yet, so it cannot fail
+		int bnum = inode_block_get(inode, 0, true);
+		if (bnum == -1) {
+			tfs_mutex_unlock(__FUNCTION__, lock);
+			inode_delete(inum);
+			return -1; // no space
+		}
+
+		void *block = data_block_get(bnum);
+		memcpy(block, target, to_write);
+		inode->i_size = to_write;
+		journal_log(block, to_write);
+		journal_log(inode, sizeof(*inode));
 	}
 
-	// write target directory size
-	size_t to_write = sizeof(target);
-    tfs_mutex_lock(__FUNCTION__, &tfs_mutex);
-	int bnum = data_block_alloc();
-	if (bnum == -1) {
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-		return -1; // no space
+    /* add the inode to directory table */
+    if (add_dir_entry(dir_inum, sub_name, inum) == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        inode_delete(inum);
+		return -1; // no space in directory
 	}
-	inode->i_data_block = bnum;
-    tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
+    tfs_mutex_unlock(__FUNCTION__, lock);
 
+	return 0;
+}
 
-	void *block = data_block_get(inode->i_data_block);
-	memcpy(block, target, to_write);
-	inode->i_size = to_write;
+int tfs_sym_link(char const *target, char const *link_name) {
+    journal_start();
+    int ret = create_sym_link(target, link_name);
+    journal_stop(true);
+    return ret;
+}
 
-	return 0;
+static int create_link(char const *target, char const *link_name) {
+    char target_name[MAX_FILE_NAME];
+    int target_dir_inum = tfs_lookup_parent(target, target_name);
+    if (target_dir_inum == -1) {
+        return -1;
+    }
+
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(link_name, sub_name);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    // lock both names, in address order
+    pthread_mutex_t *target_lock = name_lock(target_dir_inum, target_name);
+    pthread_mutex_t *lock = name_lock(dir_inum, sub_name);
+    pthread_mutex_t *first = target_lock < lock ? target_lock : lock;
+    pthread_mutex_t *second = target_lock < lock ? lock : target_lock;
+    tfs_mutex_lock(__FUNCTION__, first);
+    if (second != first) {
+        tfs_mutex_lock(__FUNCTION__, second);
+    }
+
+    int inum = find_in_dir(target_dir_inum, target_name);
+    int error = 0;
+	if (inum == -1) {
+		error = 1; // target does not exist
+	} else if (inode_get(inum)->i_node_type == T_SOFTLINK) {
+		error = 1; // can't create hardlink for softlink
+	} else if (inode_get(inum)->i_node_type == T_DIRECTORY) {
+		error = 1; // a directory has a single path
+	} else if (find_in_dir(dir_inum, sub_name) != -1) {
+		error = 1; // name already taken
+	} else if (add_dir_entry(dir_inum, sub_name, inum) == -1) {
+		error = 1; // no space in directory
+	} else {
+        tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(inum));
+        inode_t *inode = inode_get(inum);
+        inode->hard_link_count++;
+        journal_log(inode, sizeof(*inode));
+        tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+    }
+
+    if (second != first) {
+        tfs_mutex_unlock(__FUNCTION__, second);
+    }
+    tfs_mutex_unlock(__FUNCTION__, first);
+	return error ? -1 : 0;
 }
 
 int tfs_link(char const *target, char const *link_name) {
-	if (!valid_pathname(target)) {
+    journal_start();
+    int ret = create_link(target, link_name);
+    journal_stop(true);
+    return ret;
+}
+
+static int make_dir(char const *name) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(name, sub_name);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    pthread_mutex_t *lock = name_lock(dir_inum, sub_name);
+    tfs_mutex_lock(__FUNCTION__, lock);
+    if (find_in_dir(dir_inum, sub_name) != -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // name already taken
+    }
+
+    int inum = inode_create(T_DIRECTORY);
+    if (inum == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // no space in inode table or no free data blocks
+    }
+
+    if (add_dir_entry(dir_inum, sub_name, inum) == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        inode_delete(inum);
+        return -1; // no space in directory
+    }
+    tfs_mutex_unlock(__FUNCTION__, lock);
+    return 0;
+}
+
+int tfs_mkdir(char const *name) {
+    journal_start();
+    int ret = make_dir(name);
+    journal_stop(true);
+    return ret;
+}
+
+static int remove_dir(char const *name) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(name, sub_name);
+    if (dir_inum == -1) {
         return -1;
     }
 
-	inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL, "tfs_link: root dir inode must exist");
+    pthread_mutex_t *lock = name_lock(dir_inum, sub_name);
+    tfs_mutex_lock(__FUNCTION__, lock);
+    int inum = find_in_dir(dir_inum, sub_name);
+    if (inum == -1 || dir_remove_if_empty(inum) == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // missing, not a directory, or not empty
+    }
+
+    // no entries can be added to the directory anymore
+    if (clear_dir_entry(dir_inum, sub_name) == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // error deleting the dir entry
+    }
+    dcache_invalidate(name, strlen(name));
+    inode_delete(inum);
+    tfs_mutex_unlock(__FUNCTION__, lock);
+    return 0;
+}
 
-    int inum = tfs_lookup(target, ROOT_DIR_INUM);
+int tfs_rmdir(char const *name) {
+    journal_start();
+    int ret = remove_dir(name);
+    journal_stop(true);
+    return ret;
+}
 
-	if (inum == -1) {
-		return -1;
-	}
+/**
+ * Write a file's buffered appends to its blocks (see file_write_locked).
+ *
+ * Input:
+ *   - inum: the file's inumber
+ */
+static void file_flush(int inum) {
+    if (!inode_write_back_pending(inum)) {
+        return;
+    }
 
-    tfs_mutex_lock(__FUNCTION__, &tfs_mutex);
-	inode_t *inode = inode_get(inum);
-	if (inode->i_node_type == T_SOFTLINK) {
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-		return -1; // can't create hardlink for softlink
-	}
-	inode->hard_link_count++;
+    journal_start();
+    tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(inum));
+    inode_flush(inode_get(inum));
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+    journal_stop(false);
+}
 
-	if (add_dir_entry(ROOT_DIR_INUM, link_name + 1, inum) == -1) {
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-		return -1; // no space in directory
-	}
-    tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-	return 0;
+int tfs_flush(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    file_flush(file->of_inumber);
+    return 0;
 }
 
 int tfs_close(int fhandle) {
@@ -240,9 +577,167 @@ int tfs_close(int fhandle) {
         return -1; // invalid fd
     }
 
-    remove_from_open_file_table(fhandle);
+    file_flush(file->of_inumber);
+    return remove_from_open_file_table(fhandle);
+}
 
-    return 0;
+/**
+ * Write to a file at a given offset.
+ *
+ * Small appends (shorter than a block) are only added to the file's
+ * write-back buffer, so that many of them are written to the blocks at once,
+ * and the blocks are allocated only then: when the buffer fills up, the file
+ * is closed or flushed, or the flusher gets to it. Other writes flush the
+ * buffer first, and are written in place.
+ *
+ * The caller must hold the inode's lock for writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - buffer: buffer containing the contents to write
+ *   - to_write: length of the buffer contents (in bytes)
+ *   - offset: position in the file where the write starts
+ *
+ * Returns the number of bytes written (lower than to_write if the maximum file
+ * size is reached or there are no free data blocks), or -1 if nothing could be
+ * written because there are no free data blocks.
+ */
+static ssize_t file_write_locked(inode_t *inode, void const *buffer,
+                                 size_t to_write, size_t offset) {
+    // Determine how many bytes to write
+    size_t max_file_size = state_max_file_size();
+    if (offset >= max_file_size) {
+        to_write = 0;
+    } else if (to_write > max_file_size - offset) {
+        to_write = max_file_size - offset;
+    }
+
+    // Tiny files keep their data in the inode, until a write makes them grow
+    // past it
+    if (to_write > 0) {
+        if (inode_inline_write(inode, buffer, to_write, offset) == 0) {
+            return (ssize_t)to_write;
+        }
+        if (inode_inline_spill(inode) == -1) {
+            return -1; // no space
+        }
+    }
+
+    size_t block_size = state_block_size();
+    if (to_write < block_size &&
+        inode_buffer_append(inode, buffer, to_write, offset) == 0) {
+        return (ssize_t)to_write;
+    }
+    inode_flush(inode);
+
+    // Allocate the blocks that are still missing, in as few runs as
+    // possible, and keep to those that could be allocated
+    if (to_write > 0) {
+        size_t first = offset / block_size;
+        size_t count =
+            (offset + to_write + block_size - 1) / block_size - first;
+        size_t allocated = inode_blocks_alloc(inode, first, count);
+        if (allocated == 0) {
+            return -1; // no space
+        }
+        if (allocated < count) {
+            to_write = (first + allocated) * block_size - offset;
+        }
+    }
+
+    // Write an extent (or block) at a time
+    size_t written = 0;
+    while (written < to_write) {
+        size_t pos = offset + written;
+        size_t block_offset = pos % block_size;
+        size_t run;
+        int bnum = inode_block_map(inode, pos / block_size, &run);
+        ALWAYS_ASSERT(bnum != -1,
+                      "file_write_locked: data block deleted mid-write");
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > to_write - written) {
+            chunk = to_write - written;
+        }
+
+        // Perform the actual write
+        memcpy(data_run_get_for_write(bnum, block_offset, chunk),
+               buffer + written, chunk);
+        written += chunk;
+    }
+
+    if (offset + written > inode->i_size) {
+        inode->i_size = offset + written;
+        journal_log(inode, sizeof(*inode));
+    }
+    return (ssize_t)written;
+}
+
+/**
+ * Read from a file at a given offset.
+ *
+ * The caller must hold the inode's lock (for reading, at least).
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: position in the file where the read starts
+ *
+ * Returns the number of bytes read (lower than len if the end of the file is
+ * reached).
+ */
+static size_t file_read_locked(inode_t *inode, void *buffer, size_t len,
+                               size_t offset) {
+    // Determine how many bytes to read
+    size_t size = inode_file_size(inode);
+    size_t to_read = 0;
+    if (offset < size) {
+        to_read = size - offset;
+    }
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    void const *inline_data = inode_inline_get(inode);
+    if (inline_data != NULL) {
+        memcpy(buffer, (char const *)inline_data + offset, to_read);
+        return to_read;
+    }
+
+    // Read only the blocks covered by the request, an extent (or block) at a
+    // time
+    size_t block_size = state_block_size();
+    size_t done = 0;
+    while (done < to_read) {
+        size_t pos = offset + done;
+        if (pos >= inode->i_size) {
+            // the rest is still in the write-back buffer
+            inode_buffer_read(inode, buffer + done, to_read - done, pos);
+            break;
+        }
+
+        size_t block_offset = pos % block_size;
+        size_t run;
+        int bnum = inode_block_map(inode, pos / block_size, &run);
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > to_read - done) {
+            chunk = to_read - done;
+        }
+        if (chunk > inode->i_size - pos) {
+            chunk = inode->i_size - pos;
+        }
+
+        if (bnum == -1) {
+            memset(buffer + done, 0, chunk); // hole in the file
+        } else {
+            // Perform the actual read
+            memcpy(buffer + done, data_run_get(bnum, block_offset, chunk),
+                   chunk);
+        }
+        done += chunk;
+    }
+
+    return to_read;
 }
 
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
@@ -252,6 +747,7 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
         return -1;
     }
 
+    journal_start();
     tfs_mutex_lock(__FUNCTION__, &file->lock);
     
 
@@ -261,44 +757,95 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
 
 
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    // In append mode, writes go to the end of the file even if other handles
+    // made it grow since the last one
+    if (file->of_append) {
+        file->of_offset = inode_file_size(inode);
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(file->of_inumber));
-                tfs_mutex_unlock(__FUNCTION__, &file->lock);
-                return -1; // no space
-            }
-
-            inode->i_data_block = bnum;
-        }
-
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
-
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
-        
+    ssize_t written = file_write_locked(inode, buffer, to_write,
+                                        file->of_offset);
 
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
-        }
+    // The offset associated with the file handle is incremented accordingly
+    if (written > 0) {
+        file->of_offset += (size_t)written;
     }
     
     tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(file->of_inumber));
 
     tfs_mutex_unlock(__FUNCTION__, &file->lock);
+    journal_stop(false);
+
+    return written;
+}
+
+static void readahead_worker(void *arg) {
+    data_block_prefetch((int)(intptr_t)arg);
+}
+
+/**
+ * Prefetch the blocks that a sequential reader is about to read.
+ *
+ * A read that starts in the block where the previous one (through the same
+ * open file entry) ended is sequential. The blocks ahead of a sequential
+ * reader are prefetched by the readahead pool, over a window that starts at
+ * READAHEAD_MIN_BLOCKS and doubles every time the reader moves on to a new
+ * block, up to readahead_max. Other reads close the window.
+ *
+ * The caller must hold the entry's lock and the inode's lock.
+ *
+ * Input:
+ *   - file: the open file entry
+ *   - inode: the file's inode
+ *   - offset: where the read started
+ *   - read: number of bytes read
+ */
+static void readahead(open_file_entry_t *file, inode_t *inode, size_t offset,
+                      size_t read) {
+    if (readahead_pool == NULL || read == 0) {
+        return;
+    }
+
+    size_t block_size = state_block_size();
+    size_t first = offset / block_size;
+    size_t next = (offset + read) / block_size;
+    if (first != file->of_ra_next) {
+        file->of_ra_window = 0; // not sequential
+        file->of_ra_end = 0;
+    } else if (file->of_ra_window == 0) {
+        file->of_ra_window = READAHEAD_MIN_BLOCKS;
+    } else if (next > first) {
+        file->of_ra_window *= 2;
+        if (file->of_ra_window > readahead_max) {
+            file->of_ra_window = readahead_max;
+        }
+    }
+    file->of_ra_next = next;
+    if (file->of_ra_window == 0) {
+        return;
+    }
 
-    return (ssize_t)to_write;
+    size_t file_blocks = (inode->i_size + block_size - 1) / block_size;
+    size_t end = next + file->of_ra_window;
+    if (end > file_blocks) {
+        end = file_blocks;
+    }
+    size_t start = file->of_ra_end > next ? file->of_ra_end : next;
+    for (size_t i = start; i < end; i++) {
+        int bnum = inode_block_get(inode, i, false);
+        if (bnum == -1) {
+            continue; // hole
+        }
+        // not pinned: a prefetch only warms the buffer cache, so one that
+        // comes after the block is freed is harmless, and it must not keep
+        // the block from being reused (a prefetch that cannot be queued is
+        // simply skipped)
+        worker_pool_submit(readahead_pool, readahead_worker,
+                           (void *)(intptr_t)bnum);
+    }
+    if (end > file->of_ra_end) {
+        file->of_ra_end = end;
+    }
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
@@ -308,26 +855,16 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     }
     tfs_mutex_lock(__FUNCTION__, &file->lock);
     // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
+    inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
 
     tfs_rwlock_rdlock(__FUNCTION__, get_inode_lock(file->of_inumber));
 
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
-    }
-
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+    size_t to_read = file_read_locked(inode, buffer, len, file->of_offset);
+    readahead(file, inode, file->of_offset, to_read);
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
-    }
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += to_read;
 
     tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(file->of_inumber));
 
@@ -336,109 +873,956 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     return (ssize_t)to_read;
 }
 
-int tfs_unlink(char const *target) {
-
-    if (!valid_pathname(target)) {
-        return -1; // invalid pathname
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
     }
 
-    // get root dir inode
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_unlink: root dir inode must exist");
-    int inum = tfs_lookup(target, ROOT_DIR_INUM);
-    if (inum == -1) {
-        return -1; // invalid inode
-    }
+    // the handle's offset is not involved, so its lock is not needed
+    int inum = file->of_inumber;
+    journal_start();
+    tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(inum));
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_pwrite: inode of open file deleted");
 
-    // root dir cannot be deleted
-    if(inum == 0)
-    {
+    ssize_t written = file_write_locked(inode, buffer, len, offset);
+
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+    journal_stop(false);
+    return written;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
         return -1;
     }
 
-    tfs_mutex_lock(__FUNCTION__, &tfs_mutex);
+    // the handle's offset is not involved, so its lock is not needed
+    int inum = file->of_inumber;
     inode_t *inode = inode_get(inum);
-    if (inode->i_node_type == T_SOFTLINK) {
-		if (clear_dir_entry(ROOT_DIR_INUM, target+1) == -1) {
-             tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-        	return -1; // error deleting the dir entry
-    	}
-        inode_delete(inum);
-        tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-        return 0;
-    } else {
-		if (is_open(inum) == 1) {
-             tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-			return -1; // file is opened
-		}
-		if (inode->hard_link_count == 1) {
-			if (clear_dir_entry(ROOT_DIR_INUM, target+1) == -1) {
-                tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-				return -1; // error deleting the dir entry
-			}
-			inode_delete(inum);
-			tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-			return 0; 
-		} else if (inode->hard_link_count > 1) {
-            
-			if (clear_dir_entry(ROOT_DIR_INUM, target+1) == -1) {
-                tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-				return -1; // error deleting the dir entry
-			}
-			inode->hard_link_count--;
-			tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-			return 0;
-		}
-	}
-    tfs_mutex_unlock(__FUNCTION__, &tfs_mutex);
-    return -1;
-}
+    ALWAYS_ASSERT(inode != NULL, "tfs_pread: inode of open file deleted");
+
+    tfs_rwlock_rdlock(__FUNCTION__, get_inode_lock(inum));
+    size_t to_read = file_read_locked(inode, buffer, len, offset);
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+
+    return (ssize_t)to_read;
+}
+
+int tfs_fallocate(int fhandle, size_t offset, size_t len) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || len == 0 || offset > state_max_file_size() ||
+        len > state_max_file_size() - offset) {
+        return -1;
+    }
+
+    // the handle's offset is not involved, so its lock is not needed
+    int inum = file->of_inumber;
+    journal_start();
+    tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(inum));
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_fallocate: inode of open file deleted");
+
+    // buffered appends go before the range, if it is past the end of the file,
+    // and inline data goes to the first block
+    inode_flush(inode);
+
+    size_t block_size = state_block_size();
+    size_t first = offset / block_size;
+    size_t count = (offset + len + block_size - 1) / block_size - first;
+    int ret = 0;
+    if (inode_inline_spill(inode) == -1 ||
+        inode_blocks_alloc(inode, first, count) < count) {
+        ret = -1; // no space
+    } else if (offset + len > inode->i_size) {
+        inode->i_size = offset + len;
+        journal_log(inode, sizeof(*inode));
+    }
+
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+    journal_stop(false);
+    return ret;
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0) {
+        return -1;
+    }
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    journal_start();
+    tfs_mutex_lock(__FUNCTION__, &file->lock);
+    tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(file->of_inumber));
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_writev: inode of open file deleted");
+
+    if (file->of_append) {
+        file->of_offset = inode_file_size(inode);
+    }
+
+    // All segments are written under the same locks, so they end up
+    // contiguous in the file even if other threads share the handle
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t written = file_write_locked(inode, iov[i].iov_base,
+                                            iov[i].iov_len, file->of_offset);
+        if (written == -1) {
+            if (total == 0) {
+                total = -1; // no space for anything
+            }
+            break;
+        }
+
+        file->of_offset += (size_t)written;
+        total += written;
+        if ((size_t)written < iov[i].iov_len) {
+            break; // the file is full
+        }
+    }
+
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(file->of_inumber));
+    tfs_mutex_unlock(__FUNCTION__, &file->lock);
+    journal_stop(false);
+
+    return total;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0) {
+        return -1;
+    }
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    tfs_mutex_lock(__FUNCTION__, &file->lock);
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_readv: inode of open file deleted");
+
+    tfs_rwlock_rdlock(__FUNCTION__, get_inode_lock(file->of_inumber));
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t to_read = file_read_locked(inode, iov[i].iov_base,
+                                          iov[i].iov_len, file->of_offset);
+        file->of_offset += to_read;
+        total += to_read;
+        if (to_read < iov[i].iov_len) {
+            break; // end of file
+        }
+    }
+
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(file->of_inumber));
+    tfs_mutex_unlock(__FUNCTION__, &file->lock);
+
+    return (ssize_t)total;
+}
+
+ssize_t tfs_view(int fhandle, size_t offset, size_t len, tfs_view_t *views,
+                 size_t max_views) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // views point into the blocks, so what is buffered has to get there
+    int inum = file->of_inumber;
+    file_flush(inum);
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_view: inode of open file deleted");
+
+    tfs_rwlock_rdlock(__FUNCTION__, get_inode_lock(inum));
+    size_t to_view = 0;
+    if (offset < inode->i_size) {
+        to_view = inode->i_size - offset;
+    }
+    if (to_view > len) {
+        to_view = len;
+    }
+
+    // data kept in the inode is not in any block to pin, so it is copied
+    void const *inline_data = inode_inline_get(inode);
+    if (inline_data != NULL && to_view > 0 && max_views > 0) {
+        void *copy = malloc(to_view);
+        if (copy != NULL) {
+            memcpy(copy, (char const *)inline_data + offset, to_view);
+        }
+        tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+        if (copy == NULL) {
+            return -1;
+        }
+        views[0].data = copy;
+        views[0].len = to_view;
+        views[0].block = -1;
+        return 1;
+    }
+
+    size_t block_size = state_block_size();
+    size_t count = 0;
+    size_t done = 0;
+    while (done < to_view && count < max_views) {
+        size_t pos = offset + done;
+        size_t block_offset = pos % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > to_view - done) {
+            chunk = to_view - done;
+        }
+
+        tfs_view_t *view = &views[count++];
+        view->block = inode_block_get(inode, pos / block_size, false);
+        view->len = chunk;
+        if (view->block == -1) {
+            view->data = state_zero_block(); // hole in the file
+        } else {
+            data_block_pin(view->block);
+            view->data = data_block_get(view->block) + block_offset;
+        }
+        done += chunk;
+    }
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+
+    return (ssize_t)count;
+}
+
+void tfs_view_release(tfs_view_t const *views, size_t count) {
+    // the last unpin of a block removed meanwhile frees it
+    journal_start();
+    for (size_t i = 0; i < count; i++) {
+        if (views[i].block != -1) {
+            data_block_unpin(views[i].block);
+        } else if (views[i].data != state_zero_block()) {
+            free((void *)views[i].data); // copy of inline data
+        }
+    }
+    journal_stop(false);
+}
+
+static int unlink_name(char const *target) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(target, sub_name);
+    if (dir_inum == -1) {
+        return -1; // invalid pathname
+    }
+
+    pthread_mutex_t *lock = name_lock(dir_inum, sub_name);
+    tfs_mutex_lock(__FUNCTION__, lock);
+    int inum = find_in_dir(dir_inum, sub_name);
+    if (inum == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // invalid inode
+    }
+
+    inode_t *inode = inode_get(inum);
+    if (inode->i_node_type == T_DIRECTORY) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // directories are removed with tfs_rmdir
+    }
+    if (inode->i_node_type != T_SOFTLINK && is_open(inum) == 1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // file is opened
+    }
+
+    if (clear_dir_entry(dir_inum, sub_name) == -1) {
+        tfs_mutex_unlock(__FUNCTION__, lock);
+        return -1; // error deleting the dir entry
+    }
+
+    // the file itself goes away with its last link
+    tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(inum));
+    bool last_link = --inode->hard_link_count == 0;
+    journal_log(inode, sizeof(*inode));
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(inum));
+    if (last_link) {
+        inode_delete(inum);
+    }
+
+    tfs_mutex_unlock(__FUNCTION__, lock);
+    return 0;
+}
+
+int tfs_unlink(char const *target) {
+    journal_start();
+    int ret = unlink_name(target);
+    journal_stop(true);
+    return ret;
+}
+
+/**
+ * Fill a file, just truncated, with the given contents.
+ *
+ * The locks are taken once, and every block is allocated before any data is
+ * copied (in as few runs of consecutive blocks as possible), so the file is
+ * left empty if the contents do not fit. The data is then copied an extent at
+ * a time.
+ *
+ * Input:
+ *   - fhandle: file handle of the destination
+ *   - contents: the contents
+ *   - size: length of the contents
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The contents exceed the maximum file size, or there are not enough free
+ *     data blocks.
+ */
+static int file_import(int fhandle, void const *contents, size_t size) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || size > state_max_file_size()) {
+        return -1;
+    }
+
+    size_t block_size = state_block_size();
+    size_t block_count = (size + block_size - 1) / block_size;
+
+    journal_start();
+    tfs_mutex_lock(__FUNCTION__, &file->lock);
+    tfs_rwlock_wrlock(__FUNCTION__, get_inode_lock(file->of_inumber));
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "file_import: inode of open file deleted");
+    inode_flush(inode);
+
+    int ret = 0;
+    if (size > 0 && inode_inline_write(inode, contents, size, 0) == 0) {
+        file->of_offset = size; // tiny, kept in the inode
+    } else if (inode_inline_spill(inode) == -1 ||
+               inode_blocks_alloc(inode, 0, block_count) < block_count) {
+        inode_truncate(inode); // does not fit
+        ret = -1;
+    } else {
+        size_t done = 0;
+        while (done < size) {
+            size_t run;
+            int bnum = inode_block_map(inode, done / block_size, &run);
+            size_t chunk = run * block_size;
+            if (chunk > size - done) {
+                chunk = size - done;
+            }
+            memcpy(data_run_get_for_write(bnum, 0, chunk), contents + done,
+                   chunk);
+            done += chunk;
+        }
+        inode->i_size = size;
+        journal_log(inode, sizeof(*inode));
+        file->of_offset = size;
+    }
+
+    tfs_rwlock_unlock(__FUNCTION__, get_inode_lock(file->of_inumber));
+    tfs_mutex_unlock(__FUNCTION__, &file->lock);
+    journal_stop(false);
+    return ret;
+}
+
+/**
+ * Append everything that can be read from a file descriptor to a file, in
+ * large chunks.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int file_import_stream(int fhandle, int fd) {
+    char *buffer = malloc(IMPORT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int ret = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, IMPORT_BUFFER_SIZE)) != 0) {
+        if (bytes_read == -1) {
+            ret = -1;
+            break;
+        }
+        if (tfs_write(fhandle, buffer, (size_t)bytes_read) != bytes_read) {
+            ret = -1; /* file does not fit in TFS */
+            break;
+        }
+    }
+
+    free(buffer);
+    return ret;
+}
 
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
-	FILE *src;
-    int dest;
-    src = fopen(source_path, "r");
-    dest = tfs_open(dest_path,TFS_O_CREAT | TFS_O_TRUNC);
-
-	/* return -1 if src doesn't exist */
-    if (src == NULL) {
-		tfs_close(dest);
-		return -1;
-	} 
-
-	/* create a buffer to store source content */
-	char buffer[BUFFER_SIZE];
-	size_t total_bytes_read = 0;
-	size_t bytes_read;
-    ssize_t bytes_write;
-	do {
-		/* read src */
-		memset(buffer,0,sizeof(buffer));
-		bytes_read = fread(buffer, sizeof(char), sizeof(buffer), src);
-		if (bytes_read==-1) {
-			fclose(src);
-			tfs_close(dest);
-			return -1;
-		} 
-		/* write in dest */
-		bytes_write = tfs_write(dest, buffer, bytes_read);
-		if (bytes_write == -1 || bytes_write != bytes_read) {
-			fclose(src);
-			tfs_close(dest);
-			return -1;
-		}
-		total_bytes_read += bytes_read;
-	} while (bytes_read >= BUFFER_SIZE*sizeof(char) && 
-		total_bytes_read <= state_block_size());
+    int src = open(source_path, O_RDONLY);
+    if (src == -1) {
+        return -1;
+    }
 
-	if (total_bytes_read >= state_block_size()) {
-		return -1; /* file bigger than block */
-	}
+    struct stat st;
+    if (fstat(src, &st) == -1) {
+        close(src);
+        return -1;
+    }
+
+    int dest = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (dest == -1) {
+        close(src);
+        return -1;
+    }
+
+    // regular files are mapped and copied in one go; anything else (including
+    // files whose size is not known) is read in chunks
+    int ret;
+    size_t size = (size_t)st.st_size;
+    void *contents = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && size > 0) {
+        contents = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src, 0);
+    }
+    if (contents != MAP_FAILED) {
+        ret = file_import(dest, contents, size);
+        munmap(contents, size);
+    } else {
+        ret = file_import_stream(dest, src);
+    }
 
-   /* close files */
-   fclose(src);
-   tfs_close(dest);
+    close(src);
+    tfs_close(dest);
+    return ret;
+}
+
+/*
+ * A tree import or export: files are copied by the tasks of a worker pool.
+ */
+typedef struct {
+    worker_pool_t *pool;
+    tfs_tree_failure_t on_failure;
+    void *arg;
+    atomic_size_t failures;
+} tree_batch_t;
+
+typedef struct {
+    tree_batch_t *batch;
+    char *source_path;
+    char *dest_path;
+} tree_file_t;
+
+static void tree_failed(tree_batch_t *batch, char const *source_path,
+                        char const *dest_path) {
+    atomic_fetch_add(&batch->failures, 1);
+    if (batch->on_failure != NULL) {
+        batch->on_failure(source_path, dest_path, batch->arg);
+    }
+}
 
-   return 0;
+static void tree_file_free(tree_file_t *file) {
+    free(file->source_path);
+    free(file->dest_path);
+    free(file);
+}
+
+/**
+ * Worker pool task: copy one file into TécnicoFS.
+ */
+static void import_file(void *arg) {
+    tree_file_t *file = arg;
+    if (tfs_copy_from_external_fs(file->source_path, file->dest_path) == -1) {
+        tree_failed(file->batch, file->source_path, file->dest_path);
+    }
+    tree_file_free(file);
+}
+
+/**
+ * Queue the copy of a file in a tree batch.
+ *
+ * The paths are owned by the task if successful.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int tree_submit(tree_batch_t *batch, void (*copy)(void *),
+                       char *source_path, char *dest_path) {
+    tree_file_t *file = malloc(sizeof(tree_file_t));
+    if (file == NULL) {
+        return -1;
+    }
+    file->batch = batch;
+    file->source_path = source_path;
+    file->dest_path = dest_path;
+    if (worker_pool_submit(batch->pool, copy, file) == -1) {
+        free(file);
+        return -1;
+    }
+    return 0;
+}
+
+static char *path_join(char const *dir, char const *name) {
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    char *path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+/**
+ * Create a directory in TécnicoFS, unless it already exists.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int make_dir_if_missing(char const *path) {
+    if (tfs_mkdir(path) == 0 || tfs_lookup_dir(path, strlen(path)) != -1) {
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Queue the files of a directory for copying, and recurse into its
+ * subdirectories, creating them.
+ *
+ * Input:
+ *   - batch: the import
+ *   - source_dir: path of the directory in the OS' file system
+ *   - dest_dir: path of the matching directory (already created), without a
+ *     trailing '/' ("" for the root)
+ */
+static void import_dir(tree_batch_t *batch, char const *source_dir,
+                       char const *dest_dir) {
+    DIR *dir = opendir(source_dir);
+    if (dir == NULL) {
+        tree_failed(batch, source_dir, dest_dir);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *source_path = path_join(source_dir, entry->d_name);
+        char *dest_path = path_join(dest_dir, entry->d_name);
+        struct stat st;
+        if (source_path == NULL || dest_path == NULL ||
+            lstat(source_path, &st) == -1) {
+            tree_failed(batch, source_path ? source_path : entry->d_name,
+                          dest_path ? dest_path : entry->d_name);
+            free(source_path);
+            free(dest_path);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (make_dir_if_missing(dest_path) == -1) {
+                tree_failed(batch, source_path, dest_path);
+            } else {
+                import_dir(batch, source_path, dest_path);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            if (tree_submit(batch, import_file, source_path, dest_path) == 0) {
+                continue; // the task owns the paths now
+            }
+            tree_failed(batch, source_path, dest_path);
+        }
+        free(source_path);
+        free(dest_path);
+    }
+    closedir(dir);
+}
+
+/**
+ * Copy an absolute directory path of TécnicoFS without trailing '/', so that
+ * names can be appended to it ("" for the root).
+ *
+ * Returns the copy (to be freed by the caller), or NULL if the path is not
+ * absolute (or on malloc failure).
+ */
+static char *tfs_dir_path(char const *path) {
+    if (path == NULL || path[0] != '/') {
+        return NULL;
+    }
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    return strndup(path, len);
+}
+
+ssize_t tfs_import_tree(char const *source_dir, char const *dest_dir,
+                        tfs_tree_failure_t on_failure, void *arg) {
+    struct stat st;
+    if (stat(source_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+
+    char *dest = tfs_dir_path(dest_dir);
+    if (dest == NULL) {
+        return -1;
+    }
+    if (dest[0] != '\0' && make_dir_if_missing(dest) == -1) {
+        free(dest);
+        return -1;
+    }
+
+    tree_batch_t batch = {
+        .pool = worker_pool_create(worker_pool_default_size()),
+        .on_failure = on_failure,
+        .arg = arg,
+    };
+    if (batch.pool == NULL) {
+        free(dest);
+        return -1;
+    }
+    atomic_init(&batch.failures, 0);
+
+    import_dir(&batch, source_dir, dest);
+    worker_pool_destroy(batch.pool); // runs the queued copies first
+
+    free(dest);
+    return (ssize_t)atomic_load(&batch.failures);
+}
+
+/**
+ * Write the whole of an array of buffers to a file descriptor.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written == -1) {
+            return -1;
+        }
+
+        // skip what was written
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base += written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    return 0;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    int src = tfs_open(source_path, 0);
+    if (src == -1) {
+        return -1;
+    }
+
+    int dest = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest == -1) {
+        tfs_close(src);
+        return -1;
+    }
+
+    // the blocks are handed to writev as they are, EXPORT_VIEWS at a time
+    tfs_view_t views[EXPORT_VIEWS];
+    struct iovec iov[EXPORT_VIEWS];
+    size_t offset = 0;
+    ssize_t count;
+    int ret = 0;
+    while ((count = tfs_view(src, offset, SIZE_MAX, views, EXPORT_VIEWS)) > 0) {
+        for (ssize_t i = 0; i < count; i++) {
+            iov[i].iov_base = (void *)views[i].data;
+            iov[i].iov_len = views[i].len;
+            offset += views[i].len;
+        }
+        ret = write_all(dest, iov, (int)count);
+        tfs_view_release(views, (size_t)count);
+        if (ret == -1) {
+            break;
+        }
+    }
+    if (count == -1) {
+        ret = -1;
+    }
+
+    if (close(dest) == -1) {
+        ret = -1;
+    }
+    tfs_close(src);
+    return ret;
+}
+
+/**
+ * Worker pool task: copy one file out of TécnicoFS.
+ */
+static void export_file(void *arg) {
+    tree_file_t *file = arg;
+    if (tfs_copy_to_external_fs(file->source_path, file->dest_path) == -1) {
+        tree_failed(file->batch, file->source_path, file->dest_path);
+    }
+    tree_file_free(file);
+}
+
+/**
+ * Create a directory in the OS' file system, unless it already exists.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int make_host_dir_if_missing(char const *path) {
+    struct stat st;
+    if (mkdir(path, 0755) == 0 ||
+        (stat(path, &st) == 0 && S_ISDIR(st.st_mode))) {
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Queue the files of a directory for copying, and recurse into its
+ * subdirectories, creating them.
+ *
+ * Input:
+ *   - batch: the export
+ *   - inum: the directory's inumber
+ *   - source_dir: path of the directory, without a trailing '/' ("" for the
+ *     root)
+ *   - dest_dir: path of the matching directory in the OS' file system
+ *     (already created)
+ */
+static void export_dir(tree_batch_t *batch, int inum, char const *source_dir,
+                       char const *dest_dir) {
+    dir_entry_t *entries;
+    size_t count;
+    if (dir_list(inum, &entries, &count) == -1) {
+        tree_failed(batch, source_dir, dest_dir);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        char *source_path = path_join(source_dir, entries[i].d_name);
+        char *dest_path = path_join(dest_dir, entries[i].d_name);
+        if (source_path == NULL || dest_path == NULL) {
+            tree_failed(batch, source_path ? source_path : entries[i].d_name,
+                        dest_path ? dest_path : entries[i].d_name);
+            free(source_path);
+            free(dest_path);
+            continue;
+        }
+
+        int sub_inum = entries[i].d_inumber;
+        inode_type type = inode_get(sub_inum)->i_node_type;
+        if (type == T_DIRECTORY) {
+            if (make_host_dir_if_missing(dest_path) == -1) {
+                tree_failed(batch, source_path, dest_path);
+            } else {
+                export_dir(batch, sub_inum, source_path, dest_path);
+            }
+        } else if (type == T_FILE) {
+            if (tree_submit(batch, export_file, source_path, dest_path) == 0) {
+                continue; // the task owns the paths now
+            }
+            tree_failed(batch, source_path, dest_path);
+        }
+        free(source_path);
+        free(dest_path);
+    }
+    free(entries);
+}
+
+ssize_t tfs_export_tree(char const *source_dir, char const *dest_dir,
+                        tfs_tree_failure_t on_failure, void *arg) {
+    char *source = tfs_dir_path(source_dir);
+    if (source == NULL) {
+        return -1;
+    }
+    int inum = tfs_lookup_dir(source, strlen(source));
+    if (inum == -1 || make_host_dir_if_missing(dest_dir) == -1) {
+        free(source);
+        return -1;
+    }
+
+    tree_batch_t batch = {
+        .pool = worker_pool_create(worker_pool_default_size()),
+        .on_failure = on_failure,
+        .arg = arg,
+    };
+    if (batch.pool == NULL) {
+        free(source);
+        return -1;
+    }
+    atomic_init(&batch.failures, 0);
+
+    export_dir(&batch, inum, source, dest_dir);
+    worker_pool_destroy(batch.pool); // runs the queued copies first
+
+    free(source);
+    return (ssize_t)atomic_load(&batch.failures);
+}
+
+/*
+ * Ring of asynchronous operations. Each submitted operation takes one of the
+ * ring's entries until its completion is reaped, so there is always room in
+ * the completion queue for the operations in flight.
+ */
+typedef struct {
+    tfs_ring_t *ring;
+    tfs_sqe_t sqe;
+} ring_op_t;
+
+struct tfs_ring {
+    worker_pool_t *pool;
+
+    pthread_mutex_t lock;
+    pthread_cond_t completion_cond; // an operation completed
+
+    size_t entries;
+    size_t outstanding; // submitted and not reaped
+
+    // completion queue (circular)
+    tfs_cqe_t *completions;
+    size_t completion_head;
+    size_t completion_count;
+
+    // stack of entries not taken by an operation
+    ring_op_t *ops;
+    ring_op_t **free_ops;
+    size_t free_count;
+};
+
+tfs_ring_t *tfs_ring_create(size_t entries, size_t threads) {
+    if (entries == 0) {
+        return NULL;
+    }
+
+    tfs_ring_t *ring = malloc(sizeof(tfs_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->completions = malloc(entries * sizeof(tfs_cqe_t));
+    ring->ops = malloc(entries * sizeof(ring_op_t));
+    ring->free_ops = malloc(entries * sizeof(ring_op_t *));
+    ring->pool = NULL;
+    if (ring->completions != NULL && ring->ops != NULL &&
+        ring->free_ops != NULL) {
+        ring->pool = worker_pool_create(
+            threads == 0 ? worker_pool_default_size() : threads);
+    }
+    if (ring->pool == NULL) {
+        free(ring->completions);
+        free(ring->ops);
+        free(ring->free_ops);
+        free(ring);
+        return NULL;
+    }
+
+    tfs_mutex_init(__FUNCTION__, &ring->lock);
+    tfs_cond_init(__FUNCTION__, &ring->completion_cond);
+    ring->entries = entries;
+    ring->outstanding = 0;
+    ring->completion_head = 0;
+    ring->completion_count = 0;
+    for (size_t i = 0; i < entries; i++) {
+        ring->ops[i].ring = ring;
+        ring->free_ops[i] = &ring->ops[i];
+    }
+    ring->free_count = entries;
+    return ring;
+}
+
+void tfs_ring_destroy(tfs_ring_t *ring) {
+    // running the queued operations is left to the pool
+    worker_pool_destroy(ring->pool);
+
+    tfs_cond_destroy(__FUNCTION__, &ring->completion_cond);
+    tfs_mutex_destroy(__FUNCTION__, &ring->lock);
+    free(ring->completions);
+    free(ring->ops);
+    free(ring->free_ops);
+    free(ring);
+}
+
+static ssize_t ring_op_run(tfs_sqe_t const *sqe) {
+    switch (sqe->op) {
+    case TFS_OP_OPEN:
+        return tfs_open(sqe->name, sqe->mode);
+    case TFS_OP_CLOSE:
+        return tfs_close(sqe->fhandle);
+    case TFS_OP_READ:
+        return sqe->offset == TFS_OFFSET_CURRENT
+                   ? tfs_read(sqe->fhandle, sqe->buffer, sqe->len)
+                   : tfs_pread(sqe->fhandle, sqe->buffer, sqe->len,
+                               sqe->offset);
+    case TFS_OP_WRITE:
+        return sqe->offset == TFS_OFFSET_CURRENT
+                   ? tfs_write(sqe->fhandle, sqe->buffer, sqe->len)
+                   : tfs_pwrite(sqe->fhandle, sqe->buffer, sqe->len,
+                                sqe->offset);
+    case TFS_OP_UNLINK:
+        return tfs_unlink(sqe->name);
+    default:
+        return -1; // unknown operation
+    }
+}
+
+/**
+ * Post the result of an operation, freeing its entry.
+ */
+static void ring_op_complete(ring_op_t *op, ssize_t result) {
+    tfs_ring_t *ring = op->ring;
+
+    tfs_mutex_lock(__FUNCTION__, &ring->lock);
+    size_t tail =
+        (ring->completion_head + ring->completion_count) % ring->entries;
+    ring->completions[tail].result = result;
+    ring->completions[tail].user_data = op->sqe.user_data;
+    ring->completion_count++;
+    ring->free_ops[ring->free_count++] = op;
+    tfs_cond_broadcast(__FUNCTION__, &ring->completion_cond);
+    tfs_mutex_unlock(__FUNCTION__, &ring->lock);
+}
+
+static void ring_op_worker(void *arg) {
+    ring_op_t *op = arg;
+    ring_op_complete(op, ring_op_run(&op->sqe));
+}
+
+size_t tfs_ring_submit(tfs_ring_t *ring, tfs_sqe_t const *sqes, size_t count) {
+    size_t submitted = 0;
+    while (submitted < count) {
+        tfs_mutex_lock(__FUNCTION__, &ring->lock);
+        if (ring->outstanding == ring->entries) {
+            tfs_mutex_unlock(__FUNCTION__, &ring->lock);
+            break; // no room
+        }
+        ring_op_t *op = ring->free_ops[--ring->free_count];
+        ring->outstanding++;
+        tfs_mutex_unlock(__FUNCTION__, &ring->lock);
+
+        op->sqe = sqes[submitted++];
+        if (worker_pool_submit(ring->pool, ring_op_worker, op) != 0) {
+            ring_op_complete(op, -1); // could not be queued
+        }
+    }
+    return submitted;
+}
+
+size_t tfs_ring_reap(tfs_ring_t *ring, tfs_cqe_t *cqes, size_t max,
+                     size_t min_complete) {
+    if (min_complete > max) {
+        min_complete = max;
+    }
+
+    tfs_mutex_lock(__FUNCTION__, &ring->lock);
+    if (min_complete > ring->outstanding) {
+        min_complete = ring->outstanding;
+    }
+    while (ring->completion_count < min_complete) {
+        tfs_cond_wait(__FUNCTION__, &ring->completion_cond, &ring->lock);
+    }
+
+    size_t reaped = 0;
+    while (reaped < max && ring->completion_count > 0) {
+        cqes[reaped++] = ring->completions[ring->completion_head];
+        ring->completion_head = (ring->completion_head + 1) % ring->entries;
+        ring->completion_count--;
+    }
+    ring->outstanding -= reaped;
+    tfs_mutex_unlock(__FUNCTION__, &ring->lock);
+    return reaped;
 }
@@ -3,6 +3,46 @@
 
 #include "config.h"
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Emulated storage device.
+ *
+ * Accesses are spread over a number of channels by address; each channel
+ * serves one access at a time, and accesses to different channels overlap.
+ * At most queue_depth accesses are outstanding at once (further ones wait to
+ * be submitted).
+ */
+typedef struct {
+    // latency of each kind of access, in nanoseconds: reading and writing
+    // file data, and reading metadata (inodes, directories, block tables and
+    // allocation bitmaps)
+    unsigned long read_ns;
+    unsigned long write_ns;
+    unsigned long metadata_ns;
+
+    size_t channels;
+    size_t queue_depth;
+} tfs_device_params_t;
+
+/**
+ * Device statistics (see tfs_device_stats).
+ */
+typedef struct {
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long throttled; // accesses that waited for room in the queue
+} tfs_device_stats_t;
+
+/**
+ * Storage devices with predefined parameters (see tfs_device_params).
+ */
+typedef enum {
+    TFS_DEVICE_NONE,
+    TFS_DEVICE_NVME,
+    TFS_DEVICE_SATA_SSD,
+    TFS_DEVICE_HDD,
+} tfs_device_t;
 
 /**
  * TécnicoFS parameters.
@@ -13,13 +53,51 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // number of inodes and blocks kept in the buffer cache, whose accesses
+    // do not pay the storage latency (0 disables the cache)
+    size_t buffer_cache_size;
+
+    // emulated storage device (e.g. tfs_device_params(TFS_DEVICE_HDD))
+    tfs_device_params_t device;
+
+    // file holding the image of the file system, which is mounted if it
+    // exists (keeping its own geometry) and created otherwise; NULL keeps
+    // the file system in memory only
+    char const *image_path;
 } tfs_params;
 
+/**
+ * Read-only view of part of a file, pointing straight into the file system's
+ * blocks (see tfs_view).
+ */
+typedef struct {
+    void const *data;
+    size_t len;
+    // the pinned block, or -1 for a hole (which reads as zeros) or for a copy
+    // of data kept in the inode
+    int block;
+} tfs_view_t;
+
+/**
+ * Buffer cache statistics (see tfs_cache_stats).
+ */
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+} tfs_cache_stats_t;
+
 /**
  * Return a sane default set of parameters for tecnicofs.
  */
 tfs_params tfs_default_params();
 
+/**
+ * Return the parameters of a kind of storage device: typical latencies of
+ * random 4 KiB accesses and the device's internal parallelism.
+ */
+tfs_device_params_t tfs_device_params(tfs_device_t device);
+
 /**
  * Initialize tecnicofs, optionally with a given configuration.
  * Returns 0 if successful, -1 otherwise.
@@ -32,6 +110,18 @@ int tfs_init(tfs_params const *params);
  */
 int tfs_destroy();
 
+/**
+ * Obtain the number of inode and block accesses that hit and missed the
+ * buffer cache since tecnicofs was initialized.
+ */
+void tfs_cache_stats(tfs_cache_stats_t *stats);
+
+/**
+ * Obtain the number of accesses submitted to and completed by the emulated
+ * storage device since tecnicofs was initialized.
+ */
+void tfs_device_stats(tfs_device_stats_t *stats);
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -47,7 +137,8 @@ typedef enum {
  * Input:
  *   - name: absolute path name
  *   - mode: can be a combination (with bitwise or) of the following flags:
- *     - append mode (TFS_O_APPEND)
+ *     - append mode, where every write goes to the end of the file
+ *       (TFS_O_APPEND)
  *     - truncate file contents (TFS_O_TRUNC)
  *     - create file if it does not exist (TFS_O_CREAT)
  *
@@ -77,6 +168,38 @@ int tfs_sym_link(char const *target, char const *link_name);
  */
 int tfs_link(char const *target_file, char const *link_name);
 
+/**
+ * Create a directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory to be created (its parent
+ *     directory must already exist)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *name);
+
+/**
+ * Remove an empty directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rmdir(char const *name);
+
+/**
+ * Write the small appends that are still buffered for a file (see tfs_write)
+ * to its blocks. Closing a file also does it.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_flush(int fhandle);
+
 /**
  * Close a file.
  *
@@ -90,6 +213,12 @@ int tfs_close(int fhandle);
 /**
  * Write to an open file, starting at the current offset.
  *
+ * Appends shorter than a block are buffered, and only written to the file's
+ * blocks (in the background, or by tfs_flush or tfs_close) along with the
+ * appends that follow them. Reads see them all the same. Files of up to
+ * INODE_INLINE_SIZE bytes take no block at all: their data is kept in the
+ * inode, and moves to a block once the file grows past it.
+ *
  * Input:
  *   - fhandle: file handle (obtained from a previous call to tfs_open)
  *   - buffer: buffer containing the contents to write
@@ -113,6 +242,122 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write to an open file, starting at a given offset.
+ *
+ * Unlike tfs_write, the offset of the file handle is neither used nor changed
+ * (not even in append mode), so threads sharing a handle are not serialized.
+ * Writing past the end of the file leaves a hole, which reads as zeros.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: position in the file where the write starts
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file, starting at a given offset.
+ *
+ * Unlike tfs_read, the offset of the file handle is neither used nor changed,
+ * so threads sharing a handle are not serialized.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: position in the file where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Allocate the blocks of a range of an open file ahead of writing them, as
+ * runs of consecutive blocks (so that the range is read and written an
+ * extent at a time). The file grows to cover the range if needed; the new
+ * blocks read as zeros.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: position in the file where the range starts
+ *   - len: length of the range (at least 1)
+ *
+ * Returns 0 if successful, -1 otherwise (the blocks allocated before space ran
+ * out are kept, but the file does not grow).
+ */
+int tfs_fallocate(int fhandle, size_t offset, size_t len);
+
+/**
+ * Write the contents of several buffers to an open file, one after the other.
+ *
+ * The locks are taken only once for all the segments, and the data is written
+ * contiguously starting at the current offset (as in tfs_write).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: array of buffers to write
+ *   - iovcnt: number of buffers in iov
+ *
+ * Returns the total number of bytes written (can be lower than the sum of the
+ * buffer lengths if the file or the file system is full), or -1 in case of
+ * error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file into several buffers, filling each one before moving
+ * on to the next.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: array of destination buffers
+ *   - iovcnt: number of buffers in iov
+ *
+ * Returns the total number of bytes read (can be lower than the sum of the
+ * buffer lengths if the end of the file is reached), or -1 in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Obtain views of a range of an open file, without copying its contents.
+ *
+ * Each view covers the part of the range stored in one block, in order. The
+ * blocks are pinned: even if the file is truncated or deleted, they are not
+ * reused until the views are released with tfs_view_release (later writes to
+ * the same range of the file are seen through the views, though). Tiny files,
+ * whose data is kept in their inode rather than in a block, get a single view
+ * of a copy of it instead. The offset of the file handle is neither used nor
+ * changed.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: position in the file where the range starts
+ *   - len: length of the range
+ *   - views: array to fill
+ *   - max_views: length of the views array
+ *
+ * Returns the number of views filled (0 at the end of the file; the views may
+ * cover less than len bytes if the end of the file is reached or views is
+ * full), or -1 in case of error.
+ */
+ssize_t tfs_view(int fhandle, size_t offset, size_t len, tfs_view_t *views,
+                 size_t max_views);
+
+/**
+ * Release views obtained with tfs_view.
+ *
+ * Input:
+ *   - views: the views
+ *   - count: number of views
+ */
+void tfs_view_release(tfs_view_t const *views, size_t count);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -133,8 +378,176 @@ int tfs_unlink(char const *target);
  *   - dest_path: absolute path name of the destination file (in TécnicoFS),
  *    which is created if needed, and overwritten if it already exists.
  *
+ * Regular files are copied with a single write of whole blocks; if one does
+ * not fit, the destination is left empty.
+ *
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Function called for each file that tfs_import_tree or tfs_export_tree fail
+ * to copy (it may be called from several threads at the same time).
+ */
+typedef void (*tfs_tree_failure_t)(char const *source_path,
+                                     char const *dest_path, void *arg);
+
+/**
+ * Copy a directory tree of the OS' file system into TécnicoFS.
+ *
+ * Directories are created as they are found (existing ones are reused), and
+ * regular files are copied, as with tfs_copy_from_external_fs, by a pool of
+ * threads, one per core. Other kinds of files (e.g. symbolic links) are
+ * skipped. A file that cannot be copied does not stop the others.
+ *
+ * Input:
+ *   - source_dir: path name of the directory (in the OS' file system)
+ *   - dest_dir: absolute path name of the destination directory (in
+ *     TécnicoFS), "/" for the root
+ *   - on_failure: function called for each file or directory that could not
+ *     be imported, or NULL
+ *   - arg: passed to on_failure
+ *
+ * Returns the number of files and directories that could not be imported, or
+ * -1 if nothing was imported.
+ *
+ * Possible errors:
+ *   - source_dir is not a directory.
+ *   - dest_dir is not a valid path, and cannot be created.
+ *   - The worker threads cannot be started.
+ */
+ssize_t tfs_import_tree(char const *source_dir, char const *dest_dir,
+                        tfs_tree_failure_t on_failure, void *arg);
+
+/**
+ * Copy the contents of a TécnicoFS file to a file in the OS' file system.
+ *
+ * The data goes straight from the file's blocks to the destination (see
+ * tfs_view), many blocks per system call.
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - dest_path: path name of the destination file (in the OS' file system),
+ *     which is created if needed, and overwritten if it already exists
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
+/**
+ * Copy a TécnicoFS directory tree into the OS' file system.
+ *
+ * Directories are created as they are found (existing ones are reused), and
+ * regular files are copied, as with tfs_copy_to_external_fs, by a pool of
+ * threads, one per core. Symbolic links are skipped. A file that cannot be
+ * copied does not stop the others.
+ *
+ * Input:
+ *   - source_dir: absolute path name of the directory (in TécnicoFS), "/" for
+ *     the root
+ *   - dest_dir: path name of the destination directory (in the OS' file
+ *     system)
+ *   - on_failure: function called for each file or directory that could not
+ *     be exported, or NULL
+ *   - arg: passed to on_failure
+ *
+ * Returns the number of files and directories that could not be exported, or
+ * -1 if nothing was exported.
+ *
+ * Possible errors:
+ *   - source_dir is not a directory.
+ *   - dest_dir is not a directory, and cannot be created.
+ *   - The worker threads cannot be started.
+ */
+ssize_t tfs_export_tree(char const *source_dir, char const *dest_dir,
+                        tfs_tree_failure_t on_failure, void *arg);
+
+/**
+ * Operations that can be submitted to a ring (see tfs_ring_submit).
+ */
+typedef enum {
+    TFS_OP_OPEN,   // tfs_open(name, mode)
+    TFS_OP_CLOSE,  // tfs_close(fhandle)
+    TFS_OP_READ,   // tfs_pread(fhandle, buffer, len, offset)
+    TFS_OP_WRITE,  // tfs_pwrite(fhandle, buffer, len, offset)
+    TFS_OP_UNLINK, // tfs_unlink(name)
+} tfs_op_t;
+
+// Offset of reads and writes that use (and advance) the file's offset, as
+// tfs_read and tfs_write do
+#define TFS_OFFSET_CURRENT ((size_t)-1)
+
+/**
+ * Submission queue entry: an operation and its arguments. The name and buffer
+ * must stay valid until the operation completes.
+ */
+typedef struct {
+    tfs_op_t op;
+    char const *name;
+    tfs_file_mode_t mode;
+    int fhandle;
+    void *buffer; // only read from by writes
+    size_t len;
+    size_t offset;
+    void *user_data; // handed back in the completion
+} tfs_sqe_t;
+
+/**
+ * Completion queue entry: the result the operation's tfs_* function returned.
+ */
+typedef struct {
+    ssize_t result;
+    void *user_data;
+} tfs_cqe_t;
+
+typedef struct tfs_ring tfs_ring_t;
+
+/**
+ * Create a ring, through which operations are submitted to a pool of threads
+ * that runs them, and their results are collected, so that one thread can
+ * keep many operations in flight.
+ *
+ * Input:
+ *   - entries: most operations submitted and not yet reaped at once
+ *   - threads: threads running the operations (0 for one per core)
+ *
+ * Returns the ring, or NULL in case of error.
+ */
+tfs_ring_t *tfs_ring_create(size_t entries, size_t threads);
+
+/**
+ * Wait for every operation submitted to a ring to complete (without reaping
+ * them), and destroy it.
+ */
+void tfs_ring_destroy(tfs_ring_t *ring);
+
+/**
+ * Submit operations to a ring. They may run concurrently and complete in any
+ * order.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - sqes: the operations
+ *   - count: number of operations
+ *
+ * Returns the number of operations submitted, which is lower than count when
+ * the ring has no room for the others (until completions are reaped).
+ */
+size_t tfs_ring_submit(tfs_ring_t *ring, tfs_sqe_t const *sqes, size_t count);
+
+/**
+ * Collect the results of completed operations.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - cqes: where to store the results
+ *   - max: length of cqes
+ *   - min_complete: how many results to wait for (at most as many as the
+ *     operations in flight); 0 does not wait
+ *
+ * Returns the number of results stored.
+ */
+size_t tfs_ring_reap(tfs_ring_t *ring, tfs_cqe_t *cqes, size_t max,
+                     size_t min_complete);
+
 #endif // OPERATIONS_H
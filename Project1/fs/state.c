@@ -1,46 +1,152 @@
 #include "state.h"
+#include "bitmap.h"
+#include "buffer_cache.h"
+#include "device.h"
+#include "dir_index.h"
+#include "image.h"
+#include "journal.h"
 #include "locks.h"
 #include "betterassert.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in an image that is mapped into memory: backed by a file when
+ * tfs_params.image_path is set, and only in primary memory otherwise).
  */
 static tfs_params fs_params;
+static image_t image;
 
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
-static pthread_rwlock_t freeinode_ts_rwl;
+static _Atomic uint64_t *freeinode_ts_words;
+static bitmap_t freeinode_ts;
 static pthread_rwlock_t *inode_lock;
 
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
-static pthread_rwlock_t freeblocks_rwl;
+static _Atomic uint64_t *free_blocks_words;
+static bitmap_t free_blocks;
+static _Atomic uint64_t *free_block_count; // in the superblock
 
 /*
  * Volatile FS state
  */
+
+/*
+ * Free inumbers already reserved in reserved_inodes. Each thread is assigned
+ * one magazine and (almost always) is its only user, so its lock is
+ * uncontended; other threads only touch it to steal inumbers when the free
+ * ones run out.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t count;
+    int inumbers[INODE_MAGAZINE_SIZE];
+} inode_magazine_t;
+
+static inode_magazine_t *inode_magazines;
+
+/*
+ * Inumbers held in the magazines. They are only taken in freeinode_ts (and
+ * journaled) when an inode is created, so that the image never records
+ * inodes that were merely reserved: those are free again after a crash.
+ */
+static _Atomic uint64_t *reserved_inodes_words;
+static bitmap_t reserved_inodes;
+
+/*
+ * Name index of each directory. Indexes of a mounted image are built on first
+ * use (while NULL); removed directories are marked with DIR_REMOVED.
+ */
+static _Atomic(dir_index_t *) *dir_indexes;
+static dir_index_t dir_removed;
+#define DIR_REMOVED (&dir_removed)
+
+static atomic_uint magazine_threads;
+static _Thread_local unsigned thread_magazine; // 0 if not assigned yet
+
 static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
-static pthread_mutex_t free_open_file_entries_mutex;
+static _Atomic allocation_state_t *free_open_file_entries;
+
+/*
+ * Lock-free stack of free file handles. The head packs the number of updates
+ * (in the upper 32 bits, to defeat ABA) and the top handle plus one (in the
+ * lower 32 bits, 0 when the stack is empty).
+ */
+static _Atomic uint64_t free_handles_head;
+static atomic_int *free_handles_next;
+
+// Number of open file entries referring to each inode
+static atomic_int *inode_open_count;
+
+/*
+ * Number of views pinning each data block. A pinned block that is freed gets
+ * BLOCK_FREE_PENDING set instead, and is freed when its last view is
+ * released.
+ */
+static atomic_uint *block_pins;
+#define BLOCK_FREE_PENDING (1u << 31)
+
+// Contents of holes in files, as seen by views
+static char *zero_block;
+
+/*
+ * Free data blocks not promised to a write-back buffer. Every allocation
+ * takes one of them, except those that flush a buffer, which use the blocks
+ * reserved for it (reservation_credit), so that flushing never runs out of
+ * space.
+ */
+static atomic_size_t unreserved_blocks;
+static _Thread_local size_t reservation_credit;
+
+/*
+ * Write-back buffer of each file (under its inode lock): small appends not
+ * yet written to its blocks, standing for the bytes [i_size, i_size + len) of
+ * the file. The blocks they need are reserved when they are buffered, but
+ * only allocated when the buffer is flushed (see inode_flush).
+ */
+typedef struct {
+    char *data; // WRITE_BUFFER_SIZE bytes, NULL while nothing is buffered
+    size_t len;
+    size_t reserved;   // blocks reserved for the buffer
+    atomic_bool dirty; // len > 0, for the flusher to read without the lock
+} write_buffer_t;
+
+static write_buffer_t *write_buffers;
+static atomic_size_t buffered_bytes; // over all buffers
+
+// Thread flushing the write-back buffers every WRITE_BACK_INTERVAL_MS, or
+// sooner when buffered_bytes reaches WRITE_BACK_LIMIT
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock;
+static pthread_cond_t flusher_cond;
+static bool flusher_stopping;
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry_t))
+#define BLOCK_POINTERS (BLOCK_SIZE / sizeof(int))
+
+// Buffer cache keys of inodes and data blocks (also their device addresses)
+#define INODE_KEY(inumber) ((size_t)(inumber))
+#define BLOCK_KEY(block_number) (INODE_TABLE_SIZE + (size_t)(block_number))
+
+// Device address of the bitmap block holding a given bit
+#define BITMAP_ADDRESS(bit)                                                    \
+    (INODE_TABLE_SIZE + DATA_BLOCKS + (size_t)(bit) / (BLOCK_SIZE * 8))
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -57,39 +163,180 @@ static inline bool valid_file_handle(int file_handle) {
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
 /**
- * Do nothing, while preventing the compiler from performing any optimizations.
- *
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
- *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
+ * Largest file size that can be addressed by the direct, indirect and double
+ * indirect block pointers of an inode.
+ */
+size_t state_max_file_size(void) {
+    size_t blocks =
+        INODE_DIRECT_BLOCKS + BLOCK_POINTERS + BLOCK_POINTERS * BLOCK_POINTERS;
+    return blocks * BLOCK_SIZE;
+}
+
+/**
+ * Access an inode or data block (given its buffer cache key), emulating the
+ * latency of secondary storage only if it is not in the buffer cache.
  *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ * Input:
+ *   - key: buffer cache key
+ *   - op: kind of device access a miss costs
+ */
+static void storage_access(size_t key, device_op_t op) {
+    if (!buffer_cache_lookup(key)) {
+        device_access(op, key);
+        buffer_cache_insert(key);
+    }
+}
+
+/**
+ * Obtain a pointer to the contents of a block holding metadata (directory
+ * entries or block numbers).
+ */
+static void *metadata_block_get(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "metadata_block_get: invalid block number");
+
+    storage_access(BLOCK_KEY(block_number), DEVICE_METADATA);
+    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+}
+
+/**
+ * Obtain a pointer to the contents of a block that was just allocated (and so
+ * is only in primary memory, with nothing to read from storage).
+ */
+static void *fresh_block_get(int block_number) {
+    buffer_cache_insert(BLOCK_KEY(block_number));
+    void *block = &fs_data[(size_t)block_number * BLOCK_SIZE];
+    image_dirty(&image, block, BLOCK_SIZE);
+    return block;
+}
+
+/**
+ * Take up to a number of free data blocks out of unreserved_blocks.
  *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
+ * Returns how many were taken.
  */
-static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+static size_t blocks_reserve_some(size_t max) {
+    size_t available = atomic_load(&unreserved_blocks);
+    size_t taken;
+    do {
+        taken = available < max ? available : max;
+    } while (taken > 0 &&
+             !atomic_compare_exchange_weak(&unreserved_blocks, &available,
+                                           available - taken));
+    return taken;
+}
 
 /**
- * Artifically delay execution (busy loop).
+ * Take a number of free data blocks out of unreserved_blocks.
  *
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Returns true if successful, false if there are not enough of them.
+ */
+static bool blocks_reserve(size_t count) {
+    size_t available = atomic_load(&unreserved_blocks);
+    do {
+        if (available < count) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&unreserved_blocks, &available,
+                                           available - count));
+    return true;
+}
+
+/**
+ * Body of the flusher thread (see flusher_lock).
+ */
+static void *flusher_thread(void *arg) {
+    (void)arg;
+
+    tfs_mutex_lock(__FUNCTION__, &flusher_lock);
+    while (!flusher_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long ns = deadline.tv_nsec + WRITE_BACK_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += ns / 1000000000L;
+        deadline.tv_nsec = ns % 1000000000L;
+        tfs_cond_timedwait(__FUNCTION__, &flusher_cond, &flusher_lock,
+                           &deadline);
+        if (flusher_stopping) {
+            break; // state_destroy flushes what is left
+        }
+
+        tfs_mutex_unlock(__FUNCTION__, &flusher_lock);
+        state_write_back();
+        tfs_mutex_lock(__FUNCTION__, &flusher_lock);
+    }
+    tfs_mutex_unlock(__FUNCTION__, &flusher_lock);
+    return NULL;
+}
+
+/**
+ * Destroy the locks of the FS state (all of them initialized by state_init).
  */
-static void insert_delay(void) {
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
+static void state_locks_destroy(void) {
+    tfs_cond_destroy(__FUNCTION__, &flusher_cond);
+    tfs_mutex_destroy(__FUNCTION__, &flusher_lock);
+
+    for (size_t i = 0; i < INODE_MAGAZINE_COUNT; i++) {
+        tfs_mutex_destroy(__FUNCTION__, &inode_magazines[i].lock);
+    }
+	for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+		tfs_rwlock_destroy(__FUNCTION__, &inode_lock[i]);
+	}
+    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+        tfs_mutex_destroy(__FUNCTION__, &open_file_table[i].lock);
     }
 }
 
+/**
+ * Free the FS structures, and undo what state_init sets up before them (the
+ * device, the buffer cache, the journal and the image), so that TFS can be
+ * initialized again.
+ *
+ * Returns the result of unmapping the image (0 if succesful, -1 otherwise).
+ */
+static int state_release(void) {
+    device_destroy();
+    buffer_cache_destroy();
+    journal_destroy();
+    int ret = image_unmap(&image);
+    free(inode_magazines);
+    free(reserved_inodes_words);
+    free(dir_indexes);
+	free(inode_lock);
+    free(open_file_table);
+    free(free_open_file_entries);
+    free(free_handles_next);
+    free(inode_open_count);
+    free(block_pins);
+    free(zero_block);
+    free(write_buffers);
+
+    inode_table = NULL;
+    freeinode_ts_words = NULL;
+    inode_magazines = NULL;
+    reserved_inodes_words = NULL;
+    dir_indexes = NULL;
+	inode_lock = NULL;
+    fs_data = NULL;
+    free_blocks_words = NULL;
+    free_block_count = NULL;
+    open_file_table = NULL;
+    free_open_file_entries = NULL;
+    free_handles_next = NULL;
+    inode_open_count = NULL;
+    block_pins = NULL;
+    zero_block = NULL;
+    write_buffers = NULL;
+
+    return ret;
+}
+
 /**
  * Initialize FS state.
  *
+ * If params.image_path names an existing image, it is mounted (with the
+ * geometry stored in it); otherwise, an empty image is created.
+ *
  * Input:
  *   - params: TécnicoFS parameters
  *
@@ -97,135 +344,375 @@ static void insert_delay(void) {
  *
  * Possible errors:
  *   - TFS already initialized.
+ *   - The image cannot be created or mapped, or is not valid.
  *   - malloc failure when allocating TFS structures.
  */
 int state_init(tfs_params params) {
-    fs_params = params;
-
     if (inode_table != NULL) {
         return -1; // already initialized
     }
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
+    if (image_map(params.image_path, &params, sizeof(inode_t), &image) != 0) {
+        return -1;
+    }
+    if (journal_init(&image) != 0) {
+        image_unmap(&image);
+        return -1;
+    }
+    if (buffer_cache_init(params.buffer_cache_size,
+                          params.max_inode_count + params.max_block_count) !=
+        0) {
+        journal_destroy();
+        image_unmap(&image);
+        return -1;
+    }
+    if (device_init(params.device) != 0) {
+        buffer_cache_destroy();
+        journal_destroy();
+        image_unmap(&image);
+        return -1;
+    }
+    fs_params = params;
+
+    inode_table = image.inode_table;
+    freeinode_ts_words = image.inode_bitmap;
+    fs_data = image.data;
+    free_blocks_words = image.block_bitmap;
+    free_block_count = (_Atomic uint64_t *)&image.superblock->free_blocks;
+
+    inode_magazines = malloc(INODE_MAGAZINE_COUNT * sizeof(inode_magazine_t));
+    reserved_inodes_words = malloc(bitmap_word_count(INODE_TABLE_SIZE) *
+                                   sizeof(*reserved_inodes_words));
+    dir_indexes = calloc(INODE_TABLE_SIZE, sizeof(*dir_indexes));
 	inode_lock = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
     open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
     free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
-
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries || !inode_lock) {
+        malloc(MAX_OPEN_FILES * sizeof(*free_open_file_entries));
+    free_handles_next = malloc(MAX_OPEN_FILES * sizeof(*free_handles_next));
+    inode_open_count = malloc(INODE_TABLE_SIZE * sizeof(*inode_open_count));
+    block_pins = malloc(DATA_BLOCKS * sizeof(*block_pins));
+    zero_block = calloc(1, BLOCK_SIZE);
+    write_buffers = malloc(INODE_TABLE_SIZE * sizeof(*write_buffers));
+
+    if (!inode_magazines || !reserved_inodes_words || !dir_indexes ||
+        !open_file_table || !free_open_file_entries || !free_handles_next ||
+        !inode_open_count || !inode_lock || !block_pins || !zero_block ||
+        !write_buffers) {
+        state_release();
         return -1; // allocation failed
     }
 
+    bitmap_attach(&freeinode_ts, freeinode_ts_words, INODE_TABLE_SIZE);
+    bitmap_attach(&free_blocks, free_blocks_words, DATA_BLOCKS);
+    bitmap_init(&reserved_inodes, reserved_inodes_words, INODE_TABLE_SIZE);
+    atomic_init(&unreserved_blocks, (size_t)atomic_load(free_block_count));
+
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
 		tfs_rwlock_init(__FUNCTION__, &inode_lock[i]);
+        atomic_init(&inode_open_count[i], 0);
+        write_buffers[i].data = NULL;
+        write_buffers[i].len = 0;
+        write_buffers[i].reserved = 0;
+        atomic_init(&write_buffers[i].dirty, false);
     }
+    atomic_init(&buffered_bytes, 0);
 
     for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+        atomic_init(&block_pins[i], 0);
+    }
+
+    for (size_t i = 0; i < INODE_MAGAZINE_COUNT; i++) {
+        inode_magazines[i].count = 0;
+        tfs_mutex_init(__FUNCTION__, &inode_magazines[i].lock);
     }
 
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+        atomic_init(&free_open_file_entries[i], FREE);
 		tfs_mutex_init(__FUNCTION__, &open_file_table[i].lock);
+
+        // stack every handle, with 0 on top
+        atomic_init(&free_handles_next[i], (int)i + 1);
+    }
+    atomic_init(&free_handles_head, MAX_OPEN_FILES > 0 ? 1 : 0);
+    if (MAX_OPEN_FILES > 0) {
+        atomic_init(&free_handles_next[MAX_OPEN_FILES - 1], -1);
+    }
+
+    tfs_mutex_init(__FUNCTION__, &flusher_lock);
+    tfs_cond_init(__FUNCTION__, &flusher_cond);
+    flusher_stopping = false;
+    if (pthread_create(&flusher, NULL, flusher_thread, NULL) != 0) {
+        state_locks_destroy();
+        state_release();
+        return -1;
     }
 
-	tfs_rwlock_init(__FUNCTION__, &freeinode_ts_rwl);
-	tfs_rwlock_init(__FUNCTION__, &freeblocks_rwl);
-	tfs_mutex_init(__FUNCTION__, &free_open_file_entries_mutex);
     return 0;
 }
 
+/**
+ * Whether state_init mounted an existing image (rather than creating an empty
+ * one).
+ */
+bool state_mounted(void) { return !image.formatted; }
+
 /**
  * Destroy FS state.
  *
+ * The write-back buffers are flushed, and the image is written back to its
+ * file (so its journal is left empty).
+ *
  * Returns 0 if succesful, -1 otherwise.
  */
 int state_destroy(void) {
-	tfs_mutex_destroy(__FUNCTION__, &free_open_file_entries_mutex);
-	tfs_rwlock_destroy(__FUNCTION__, &freeblocks_rwl);
-	tfs_rwlock_destroy(__FUNCTION__, &freeinode_ts_rwl);
-
-	for(int i=0; i<INODE_TABLE_SIZE; i++) {
-		tfs_rwlock_destroy(__FUNCTION__, &inode_lock[i]);
+    tfs_mutex_lock(__FUNCTION__, &flusher_lock);
+    flusher_stopping = true;
+    tfs_cond_signal(__FUNCTION__, &flusher_cond);
+    tfs_mutex_unlock(__FUNCTION__, &flusher_lock);
+    pthread_join(flusher, NULL);
+
+    state_write_back();
+
+	for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+		if (dir_indexes[i] != DIR_REMOVED) {
+			dir_index_destroy(dir_indexes[i]);
+		}
 	}
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        tfs_mutex_destroy(__FUNCTION__, &open_file_table[i].lock);
+    state_locks_destroy();
+    return state_release();
+}
+
+pthread_rwlock_t *get_inode_lock(int inum) {
+	return &inode_lock[inum];
+}
+
+/**
+ * Simulate the storage access delay of a bitmap search: one access to each
+ * block of the bitmap holding words it looked at.
+ */
+static void bitmap_scan_access(bitmap_t const *bitmap,
+                               bitmap_scan_t const *scan) {
+    size_t words_per_block = BLOCK_SIZE / sizeof(uint64_t);
+    size_t word = scan->first;
+    size_t left = scan->count;
+    while (left > 0) {
+        device_access(DEVICE_METADATA, BITMAP_ADDRESS(word * BITMAP_WORD_BITS));
+
+        // the rest of this block's words, up to the end of the bitmap
+        size_t words = words_per_block - word % words_per_block;
+        if (words > bitmap->word_count - word) {
+            words = bitmap->word_count - word;
+        }
+        if (words > left) {
+            words = left;
+        }
+        left -= words;
+        word += words;
+        if (word == bitmap->word_count) {
+            word = 0;
+        }
     }
+}
 
-    free(inode_table);
-    free(freeinode_ts);
-	free(inode_lock);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
+/**
+ * Record a change to the word of a bitmap that holds a given bit.
+ */
+static void journal_log_bit(_Atomic uint64_t const *words, size_t bit) {
+    journal_log_word(&words[bit / BITMAP_WORD_BITS]);
+}
 
-    inode_table = NULL;
-    freeinode_ts = NULL;
-	inode_lock = NULL;
-    fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+/**
+ * Obtain the inumber magazine of the calling thread.
+ */
+static inode_magazine_t *inode_magazine_get(void) {
+    if (thread_magazine == 0) {
+        thread_magazine = atomic_fetch_add(&magazine_threads, 1) + 1;
+    }
+    return &inode_magazines[(thread_magazine - 1) % INODE_MAGAZINE_COUNT];
+}
 
+/**
+ * Reserve a batch of free inumbers (free in freeinode_ts, and not held by
+ * another magazine) into a magazine.
+ *
+ * The caller must hold the magazine's lock.
+ */
+static void inode_magazine_refill(inode_magazine_t *magazine) {
+    int batch[INODE_MAGAZINE_SIZE / 2];
+    size_t reserved = 0;
+    while (reserved < INODE_MAGAZINE_SIZE / 2) {
+        bitmap_scan_t scan;
+        ssize_t inumber =
+            bitmap_alloc_excluding(&reserved_inodes, &freeinode_ts, &scan);
+        bitmap_scan_access(&freeinode_ts, &scan);
+
+        if (inumber == -1) {
+            break;
+        }
+        batch[reserved++] = (int)inumber;
+    }
 
-    return 0;
+    // stack them so that the lowest inumber is handed out first
+    while (reserved > 0) {
+        magazine->inumbers[magazine->count++] = batch[--reserved];
+    }
 }
 
-pthread_rwlock_t *get_inode_lock(int inum) {
-	return &inode_lock[inum];
+/**
+ * Take a reserved inumber in freeinode_ts, and release its reservation.
+ */
+static int inode_take(int inumber) {
+    // simulate storage access delay to freeinode_ts
+    device_access(DEVICE_METADATA, BITMAP_ADDRESS(inumber));
+    bool was_free = bitmap_set(&freeinode_ts, (size_t)inumber);
+    ALWAYS_ASSERT(was_free, "inode_alloc: reserved inumber already in use");
+    journal_log_bit(freeinode_ts_words, (size_t)inumber);
+    bitmap_free(&reserved_inodes, (size_t)inumber);
+    return inumber;
 }
 
 /**
  * (Try to) Allocate a new inode in the inode table, without initializing its
  * data.
  *
+ * Inumbers come from the calling thread's magazine, which is refilled in
+ * batches of free inumbers. Only when there are no more of those are the
+ * magazines of other threads searched.
+ *
  * Returns the inumber of the newly allocated inode, or -1 in the case of error.
  *
  * Possible errors:
  *   - No free slots in inode table.
  */
 static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+    inode_magazine_t *magazine = inode_magazine_get();
+
+    tfs_mutex_lock(__FUNCTION__, &magazine->lock);
+    if (magazine->count == 0) {
+        inode_magazine_refill(magazine);
+    }
+    if (magazine->count > 0) {
+        int inumber = magazine->inumbers[--magazine->count];
+        tfs_mutex_unlock(__FUNCTION__, &magazine->lock);
+        return inode_take(inumber);
+    }
+    tfs_mutex_unlock(__FUNCTION__, &magazine->lock);
+
+    // steal an inumber reserved by another thread
+    for (size_t i = 0; i < INODE_MAGAZINE_COUNT; i++) {
+        inode_magazine_t *other = &inode_magazines[i];
+        tfs_mutex_lock(__FUNCTION__, &other->lock);
+        if (other->count > 0) {
+            int inumber = other->inumbers[--other->count];
+            tfs_mutex_unlock(__FUNCTION__, &other->lock);
+            return inode_take(inumber);
         }
+        tfs_mutex_unlock(__FUNCTION__, &other->lock);
+    }
 
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            tfs_rwlock_unlock(__FUNCTION__, &freeinode_ts_rwl);
-            tfs_rwlock_wrlock(__FUNCTION__, &freeinode_ts_rwl);
+    // no free inodes
+    return -1;
+}
 
-            if (freeinode_ts[inumber] != FREE) {
-                tfs_rwlock_unlock(__FUNCTION__, &freeinode_ts_rwl);
-                tfs_rwlock_rdlock(__FUNCTION__, &freeinode_ts_rwl);
-                continue;
-            }
+/**
+ * Return an inumber to the allocator.
+ *
+ * The inumber is freed in freeinode_ts, and kept in the calling thread's
+ * magazine, unless it is full.
+ */
+static void inode_free(int inumber) {
+    // reserved before it becomes free, so that no other magazine claims it
+    bitmap_set(&reserved_inodes, (size_t)inumber);
+
+    // simulate storage access delay to freeinode_ts
+    device_access(DEVICE_METADATA, BITMAP_ADDRESS(inumber));
+    bitmap_free(&freeinode_ts, (size_t)inumber);
+    journal_log_bit(freeinode_ts_words, (size_t)inumber);
+
+    inode_magazine_t *magazine = inode_magazine_get();
+    tfs_mutex_lock(__FUNCTION__, &magazine->lock);
+    if (magazine->count < INODE_MAGAZINE_SIZE) {
+        magazine->inumbers[magazine->count++] = inumber;
+        tfs_mutex_unlock(__FUNCTION__, &magazine->lock);
+        return;
+    }
+    tfs_mutex_unlock(__FUNCTION__, &magazine->lock);
+    bitmap_free(&reserved_inodes, (size_t)inumber);
+}
 
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
+/**
+ * Mark every block pointer and extent of an inode as unused. Files and
+ * symbolic links start over with their (empty) data inline.
+ */
+static void inode_clear_blocks(inode_t *inode) {
+    inode->i_inline = inode->i_node_type != T_DIRECTORY;
+    memset(inode->i_inline_data, 0, sizeof(inode->i_inline_data));
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_direct[i] = -1;
+    }
+    inode->i_indirect = -1;
+    inode->i_double_indirect = -1;
+    for (size_t i = 0; i < INODE_EXTENTS; i++) {
+        inode->i_extents[i].e_block = -1;
+        inode->i_extents[i].e_length = 0;
+    }
+}
 
-            return (int)inumber;
-        }
+/**
+ * Add a block of empty entries to the end of a directory.
+ *
+ * Entries are labeled with inumber==-1 and their slots are added to the
+ * directory's index, so that they are handed out from the lowest one.
+ *
+ * Input:
+ *   - inode: the directory's inode (the caller must hold its lock for writing,
+ *     or otherwise have exclusive access to it)
+ *   - inum: the directory's inumber
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ *   - Directory reached the maximum file size.
+ */
+static int dir_grow(inode_t *inode, int inum) {
+    size_t file_block = inode->i_size / BLOCK_SIZE;
+    int bnum = inode_block_get(inode, file_block, true);
+    if (bnum == -1) {
+        return -1;
     }
 
-    // no free inodes
-    return -1;
+    dir_entry_t *dir_entry = (dir_entry_t *)fresh_block_get(bnum);
+    ALWAYS_ASSERT(dir_entry != NULL, "dir_grow: data block freed while in use");
+    for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        dir_entry[i].d_inumber = -1;
+    }
+    journal_log(dir_entry, BLOCK_SIZE);
+
+    // the block belongs to the directory from now on, even if some of its
+    // slots cannot be recorded as free below (they simply go unused)
+    inode->i_size += BLOCK_SIZE;
+    journal_log(inode, sizeof(*inode));
+
+    size_t first_slot = file_block * DIR_ENTRIES_PER_BLOCK;
+    for (size_t i = DIR_ENTRIES_PER_BLOCK; i > 0; i--) {
+        if (dir_index_push_free(dir_indexes[inum],
+                                (int)(first_slot + i - 1)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
 /**
  * Create a new inode in the inode table.
  *
  * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Directories will have their first data block allocated and initialized, with
+ * i_size set to BLOCK_SIZE (further blocks are added as entries are needed).
+ * Regular files will not have any data block allocated (i_size will be set to
+ * 0 and all block pointers to -1).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -237,60 +724,45 @@ static int inode_alloc(void) {
  *   - (if creating a directory) No free data blocks.
  */
 int inode_create(inode_type i_type) {
-    tfs_rwlock_rdlock(__FUNCTION__, &freeinode_ts_rwl);
     int inumber = inode_alloc();
     if (inumber == -1) {
         return -1; // no free slots in inode table
     }
 
     inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
+    storage_access(INODE_KEY(inumber), DEVICE_METADATA);
 
     inode->i_node_type = i_type;
 	inode->hard_link_count = 1;
+    inode_clear_blocks(inode);
     switch (i_type) {
     case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-
+        // Initializes directory with a single block of empty entries
+        inode->i_size = 0;
+        dir_indexes[inumber] = dir_index_create();
+        if (dir_indexes[inumber] == NULL || dir_grow(inode, inumber) == -1) {
             // run regular deletion process
-            freeinode_ts[inumber] = FREE;
-            tfs_rwlock_unlock(__FUNCTION__, &freeinode_ts_rwl);
+            dir_index_destroy(dir_indexes[inumber]);
+            dir_indexes[inumber] = DIR_REMOVED;
+            inode_truncate(inode);
+            inode_free(inumber);
             return -1;
         }
-
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
-
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
     } break;
     case T_FILE:
         // In case of a new file, simply sets its size to 0
         inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
         break;
 	case T_SOFTLINK:
 	    // In case of a new softlink, simply sets its size to 0
         inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
 		break;
     default:
         /* no need to unlock as the program will crash */
         PANIC("inode_create: unknown file type");
     }
 
-    tfs_rwlock_unlock(__FUNCTION__, &freeinode_ts_rwl);
+    journal_log(inode, sizeof(*inode));
     return inumber;
 }
 
@@ -301,22 +773,24 @@ int inode_create(inode_type i_type) {
  *   - inumber: inode's number
  */
 void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
-
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
 
-    tfs_rwlock_wrlock(__FUNCTION__, &freeinode_ts_rwl);
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
+    storage_access(INODE_KEY(inumber), DEVICE_METADATA);
+
+    ALWAYS_ASSERT(bitmap_test(&freeinode_ts, (size_t)inumber),
                   "inode_delete: inode already freed");
 
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+    inode_truncate(&inode_table[inumber]);
+
+    // lookups still holding the inumber of a removed directory find it empty
+    tfs_rwlock_wrlock(__FUNCTION__, &inode_lock[inumber]);
+    if (dir_indexes[inumber] != DIR_REMOVED) {
+        dir_index_destroy(dir_indexes[inumber]);
+        dir_indexes[inumber] = DIR_REMOVED;
     }
-    
-    freeinode_ts[inumber] = FREE;
-    tfs_rwlock_unlock(__FUNCTION__, &freeinode_ts_rwl);
+    tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inumber]);
+
+    inode_free(inumber);
 }
 
 /**
@@ -330,135 +804,1011 @@ void inode_delete(int inumber) {
 inode_t *inode_get(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
 
-    insert_delay(); // simulate storage access delay to inode
+    storage_access(INODE_KEY(inumber), DEVICE_METADATA);
     return &inode_table[inumber];
 }
 
 /**
- * Clear the directory entry associated with a sub file.
- *
- * Input:
- *   - inumber: directory inumber
- *   - sub_name: sub file name
- *
- * Returns 0 if successful, -1 otherwise.
+ * Allocate a block to be used as a table of block numbers, with every entry
+ * marked as unused.
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ * Returns the block number, or -1 if there are no free data blocks.
  */
-int clear_dir_entry(int inum, char const *sub_name) {
-	inode_t *inode = inode_get(inum);
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+static int pointer_block_alloc(void) {
+    int bnum = data_block_alloc();
+    if (bnum == -1) {
+        return -1;
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-    
-    tfs_rwlock_wrlock(__FUNCTION__, &inode_lock[inum]);
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
-            return 0;
-        }
+    int *pointers = (int *)fresh_block_get(bnum);
+    for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+        pointers[i] = -1;
     }
-    tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
-    return -1; // sub_name not found
+    journal_log(pointers, BLOCK_SIZE);
+    return bnum;
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Follow (and, if requested, fill) a pointer to a table of block numbers.
  *
  * Input:
- *   - inumber: directory inumber
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
+ *   - slot: the pointer to follow
+ *   - alloc: whether to allocate a table when the pointer is unused
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns the block number, or -1 if unused/allocation failed.
+ */
+static int block_slot_get(int *slot, bool alloc) {
+    if (*slot != -1 || !alloc) {
+        return *slot;
+    }
+
+    int bnum = pointer_block_alloc();
+    if (bnum != -1) {
+        *slot = bnum;
+        journal_log(slot, sizeof(*slot));
+    }
+    return bnum;
+}
+
+/**
+ * Find the pointer to a given block of a file, following (and, if requested,
+ * allocating) the tables of block numbers on the way to it.
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ * Only the pointer blocks on the path to the requested block are accessed, so
+ * the cost does not depend on the size of the file.
+ *
+ * Returns the pointer, or NULL if a table is missing (or could not be
+ * allocated) or file_block is beyond the maximum file size.
  */
-int add_dir_entry(int inum, char const *sub_name, int sub_inumber) {
-	inode_t *inode = inode_get(inum);
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        return -1; // invalid sub_name
+static int *inode_block_slot(inode_t *inode, size_t file_block, bool alloc) {
+    if (file_block < INODE_DIRECT_BLOCKS) {
+        return &inode->i_direct[file_block];
     }
+    file_block -= INODE_DIRECT_BLOCKS;
 
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+    if (file_block < BLOCK_POINTERS) {
+        int indirect = block_slot_get(&inode->i_indirect, alloc);
+        if (indirect == -1) {
+            return NULL;
+        }
+        int *pointers = (int *)metadata_block_get(indirect);
+        return &pointers[file_block];
     }
+    file_block -= BLOCK_POINTERS;
 
+    if (file_block < BLOCK_POINTERS * BLOCK_POINTERS) {
+        int dindirect = block_slot_get(&inode->i_double_indirect, alloc);
+        if (dindirect == -1) {
+            return NULL;
+        }
+        int *indirects = (int *)metadata_block_get(dindirect);
+        int indirect =
+            block_slot_get(&indirects[file_block / BLOCK_POINTERS], alloc);
+        if (indirect == -1) {
+            return NULL;
+        }
+        int *pointers = (int *)metadata_block_get(indirect);
+        return &pointers[file_block % BLOCK_POINTERS];
+    }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+    return NULL; // beyond maximum file size
+}
 
-    tfs_rwlock_wrlock(__FUNCTION__, &inode_lock[inum]);
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
-            tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
-            return 0;
+/**
+ * Find the extent of an inode that holds a given block of the file.
+ *
+ * Returns the extent, or NULL if the block is in none of them.
+ */
+static extent_t const *inode_extent_find(inode_t const *inode,
+                                         size_t file_block) {
+    for (size_t i = 0; i < INODE_EXTENTS; i++) {
+        extent_t const *extent = &inode->i_extents[i];
+        if (extent->e_block != -1 && file_block >= extent->e_file_block &&
+            file_block - extent->e_file_block < extent->e_length) {
+            return extent;
         }
     }
-    tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
-    return -1; // no space for entry
+    return NULL;
 }
 
 /**
- * Obtain the inumber for a sub file inside a directory.
+ * Record a run of blocks just allocated to a file, extending the extent that
+ * it continues (in the file and in the data blocks) if there is one.
+ * Otherwise, it takes an unused extent or, if it is longer, the place of the
+ * shortest one.
  *
  * Input:
- *   - inum: directory inumber
- *   - sub_name: sub file name
- *
- * Returns inumber linked to the target name, -1 if errors occur.
+ *   - inode: the file's inode
+ *   - file_block: index of the first block of the run within the file
+ *   - bnum: first data block of the run
+ *   - count: number of blocks
+ */
+static void inode_extent_add(inode_t *inode, size_t file_block, int bnum,
+                             size_t count) {
+    extent_t *unused = NULL;
+    extent_t *shortest = NULL;
+    for (size_t i = 0; i < INODE_EXTENTS; i++) {
+        extent_t *extent = &inode->i_extents[i];
+        if (extent->e_block == -1) {
+            unused = extent;
+        } else if (extent->e_file_block + extent->e_length == file_block &&
+                   extent->e_block + (int)extent->e_length == bnum) {
+            extent->e_length += count;
+            journal_log(inode, sizeof(*inode));
+            return;
+        } else if (shortest == NULL || extent->e_length < shortest->e_length) {
+            shortest = extent;
+        }
+    }
+
+    extent_t *target = unused;
+    if (target == NULL) {
+        if (shortest->e_length >= count) {
+            return; // the extents already cover longer runs
+        }
+        target = shortest;
+    }
+    target->e_file_block = file_block;
+    target->e_block = bnum;
+    target->e_length = count;
+    journal_log(inode, sizeof(*inode));
+}
+
+/**
+ * Make sure that consecutive blocks of a file are allocated.
+ *
+ * Each stretch of missing blocks gets a run of consecutive data blocks, taken
+ * in a single allocator operation (see data_block_alloc_run) and recorded as
+ * an extent. The tables of block numbers they need are allocated first, so
+ * that they do not break up the run.
+ *
+ * Input:
+ *   - inode: the file's inode (the caller must hold its lock for writing, or
+ *     otherwise have exclusive access to it)
+ *   - first: index of the first block within the file
+ *   - count: number of blocks
+ *
+ * Returns the number of blocks allocated (or already there) from first on,
+ * lower than count if there are not enough free data blocks or the maximum
+ * file size is reached.
+ */
+size_t inode_blocks_alloc(inode_t *inode, size_t first, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        int *slot = inode_block_slot(inode, first + done, true);
+        if (slot == NULL) {
+            break; // no space for a table, or beyond maximum file size
+        }
+        if (*slot != -1) {
+            done++;
+            continue;
+        }
+
+        size_t missing = 1;
+        while (done + missing < count) {
+            int const *next =
+                inode_block_slot(inode, first + done + missing, true);
+            if (next == NULL || *next != -1) {
+                break;
+            }
+            missing++;
+        }
+
+        size_t run;
+        int bnum = data_block_alloc_run(missing, &run);
+        if (bnum == -1) {
+            break; // no space
+        }
+        for (size_t i = 0; i < run; i++) {
+            int *block_slot = inode_block_slot(inode, first + done + i, false);
+            // fresh data blocks read as zeros, even if only partially written
+            // (also after a crash, so the zeros are ordered as file data)
+            void *block = fresh_block_get(bnum + (int)i);
+            memset(block, 0, BLOCK_SIZE);
+            image_dirty_data(&image, block, BLOCK_SIZE);
+            *block_slot = bnum + (int)i;
+            journal_log(block_slot, sizeof(*block_slot));
+        }
+        inode_extent_add(inode, first + done, bnum, run);
+        done += run;
+    }
+    return done;
+}
+
+/**
+ * Obtain the data block holding a given block of a file, along with the
+ * number of blocks of the file that follow it in consecutive data blocks (as
+ * far as the inode's extents tell).
+ *
+ * Input:
+ *   - inode: the file's inode (the caller must hold its lock)
+ *   - file_block: index of the block within the file
+ *   - run: set to the number of consecutive blocks from file_block on (1 if
+ *     the block is not in an extent, or is not mapped)
+ *
+ * Returns the block number, or -1 if the block is not mapped.
+ */
+int inode_block_map(inode_t *inode, size_t file_block, size_t *run) {
+    extent_t const *extent = inode_extent_find(inode, file_block);
+    if (extent != NULL) {
+        size_t skip = file_block - extent->e_file_block;
+        *run = extent->e_length - skip;
+        return extent->e_block + (int)skip;
+    }
+
+    *run = 1;
+    int const *slot = inode_block_slot(inode, file_block, false);
+    return slot == NULL ? -1 : *slot;
+}
+
+/**
+ * Obtain the data block holding a given block of a file.
+ *
+ * Blocks in one of the inode's extents are found without accessing any
+ * pointer block; otherwise, only the pointer blocks on the path to the
+ * requested block are accessed.
+ *
+ * Input:
+ *   - inode: the file's inode (the caller must hold its lock for writing if
+ *     alloc is true)
+ *   - file_block: index of the block within the file
+ *   - alloc: whether missing blocks should be allocated
+ *
+ * Returns the block number, or -1 if the block is not mapped (or could not be
+ * allocated).
+ *
+ * Possible errors:
+ *   - file_block is beyond the maximum file size.
+ *   - No free data blocks.
+ */
+int inode_block_get(inode_t *inode, size_t file_block, bool alloc) {
+    if (alloc && inode_blocks_alloc(inode, file_block, 1) == 0) {
+        return -1;
+    }
+
+    size_t run;
+    return inode_block_map(inode, file_block, &run);
+}
+
+/**
+ * Free every block referenced by a table of block numbers.
+ *
+ * Input:
+ *   - bnum: the pointer block
+ *   - depth: 1 if the entries are data blocks, 2 if they are pointer blocks
+ */
+static void pointer_block_free(int bnum, int depth) {
+    int const *pointers = (int const *)metadata_block_get(bnum);
+    for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+        if (pointers[i] == -1) {
+            continue;
+        }
+        if (depth > 1) {
+            pointer_block_free(pointers[i], depth - 1);
+        } else {
+            data_block_free(pointers[i]);
+        }
+    }
+    data_block_free(bnum);
+}
+
+/**
+ * Count the blocks that writing to some blocks of a file would allocate: the
+ * missing data blocks, and the missing tables of block numbers on the way to
+ * them.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first: index of the first block within the file
+ *   - end: index of the block after the last one
+ */
+static size_t inode_blocks_missing(inode_t *inode, size_t first, size_t end) {
+    size_t missing = 0;
+    // missing tables already counted: the last indirect one (0 for
+    // i_indirect, i for the i-th one of i_double_indirect), and the double
+    // indirect one
+    size_t table_counted = SIZE_MAX;
+    bool double_counted = false;
+
+    for (size_t file_block = first; file_block < end; file_block++) {
+        if (file_block < INODE_DIRECT_BLOCKS) {
+            missing += inode->i_direct[file_block] == -1;
+            continue;
+        }
+
+        size_t index = file_block - INODE_DIRECT_BLOCKS;
+        int const *pointers = NULL;
+        if (index < BLOCK_POINTERS) {
+            if (inode->i_indirect != -1) {
+                pointers = metadata_block_get(inode->i_indirect);
+            } else if (table_counted != 0) {
+                missing++;
+                table_counted = 0;
+            }
+        } else {
+            index -= BLOCK_POINTERS;
+            size_t table = 1 + index / BLOCK_POINTERS;
+            index %= BLOCK_POINTERS;
+
+            int indirect = -1;
+            if (inode->i_double_indirect != -1) {
+                int const *indirects =
+                    metadata_block_get(inode->i_double_indirect);
+                indirect = indirects[table - 1];
+            } else if (!double_counted) {
+                missing++;
+                double_counted = true;
+            }
+            if (indirect != -1) {
+                pointers = metadata_block_get(indirect);
+            } else if (table_counted != table) {
+                missing++;
+                table_counted = table;
+            }
+        }
+        missing += pointers == NULL || pointers[index] == -1;
+    }
+    return missing;
+}
+
+/**
+ * Forget what a write-back buffer holds, releasing its reservation.
+ */
+static void write_buffer_clear(write_buffer_t *buffer) {
+    atomic_fetch_add(&unreserved_blocks, buffer->reserved);
+    atomic_fetch_sub(&buffered_bytes, buffer->len);
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->reserved = 0;
+    atomic_store(&buffer->dirty, false);
+}
+
+/**
+ * Size of a file, counting the appends still in its write-back buffer.
+ *
+ * The caller must hold the inode's lock (for reading, at least).
+ */
+size_t inode_file_size(inode_t const *inode) {
+    return inode->i_size + write_buffers[inode - inode_table].len;
+}
+
+/**
+ * Check whether a file has appends in its write-back buffer (without its
+ * lock, so the answer may be stale by the time it is used).
+ */
+bool inode_write_back_pending(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "inode_write_back_pending: invalid inumber");
+    return atomic_load(&write_buffers[inumber].dirty);
+}
+
+/**
+ * Add an append to the write-back buffer of a file, instead of writing it to
+ * the file's blocks. The blocks it needs are reserved, so that flushing it
+ * cannot fail.
+ *
+ * Input:
+ *   - inode: the file's inode (the caller must hold its lock for writing)
+ *   - buffer: contents to append
+ *   - len: length of the contents
+ *   - offset: where the write goes (only writes at the end of the file can be
+ *     buffered)
+ *
+ * Returns 0 if the write was buffered, -1 otherwise (and then it has to be
+ * written to the blocks, after flushing the buffer).
+ *
+ * Possible errors:
+ *   - The write is not an append, or does not fit in the buffer.
+ *   - Too much is buffered over all files (the flusher is woken up).
+ *   - There are not enough free data blocks.
+ *   - malloc failure.
+ */
+int inode_buffer_append(inode_t *inode, void const *buffer, size_t len,
+                        size_t offset) {
+    write_buffer_t *wb = &write_buffers[inode - inode_table];
+    if (len == 0 || offset != inode->i_size + wb->len ||
+        len > WRITE_BUFFER_SIZE || offset + len > state_max_file_size()) {
+        return -1;
+    }
+    if (atomic_load(&buffered_bytes) + len > WRITE_BACK_LIMIT) {
+        tfs_mutex_lock(__FUNCTION__, &flusher_lock);
+        tfs_cond_signal(__FUNCTION__, &flusher_cond);
+        tfs_mutex_unlock(__FUNCTION__, &flusher_lock);
+        return -1;
+    }
+    if (wb->len + len > WRITE_BUFFER_SIZE) {
+        inode_flush(inode); // full, start over
+    }
+
+    if (wb->data == NULL) {
+        wb->data = malloc(WRITE_BUFFER_SIZE);
+        if (wb->data == NULL) {
+            return -1;
+        }
+    }
+
+    size_t end = inode->i_size + wb->len + len;
+    size_t needed = inode_blocks_missing(inode, inode->i_size / BLOCK_SIZE,
+                                         (end + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (needed > wb->reserved) {
+        if (!blocks_reserve(needed - wb->reserved)) {
+            if (wb->len == 0) {
+                write_buffer_clear(wb);
+            }
+            return -1; // no space
+        }
+        wb->reserved = needed;
+    }
+
+    memcpy(wb->data + wb->len, buffer, len);
+    wb->len += len;
+    atomic_fetch_add(&buffered_bytes, len);
+    atomic_store(&wb->dirty, true);
+    return 0;
+}
+
+/**
+ * Read appends from the write-back buffer of a file.
+ *
+ * Input:
+ *   - inode: the file's inode (the caller must hold its lock, for reading at
+ *     least)
+ *   - buffer: destination buffer
+ *   - len: number of bytes to read (all of them buffered)
+ *   - offset: position in the file where the read starts (at least i_size)
+ */
+void inode_buffer_read(inode_t const *inode, void *buffer, size_t len,
+                       size_t offset) {
+    write_buffer_t const *wb = &write_buffers[inode - inode_table];
+    ALWAYS_ASSERT(offset >= inode->i_size &&
+                      offset + len <= inode->i_size + wb->len,
+                  "inode_buffer_read: read beyond the buffered appends");
+    memcpy(buffer, wb->data + (offset - inode->i_size), len);
+}
+
+/**
+ * Write the write-back buffer of a file to its blocks, allocating them (from
+ * the blocks reserved for it) only now.
+ *
+ * Input:
+ *   - inode: the file's inode (the caller must hold its lock for writing, or
+ *     otherwise have exclusive access to it)
+ */
+void inode_flush(inode_t *inode) {
+    write_buffer_t *wb = &write_buffers[inode - inode_table];
+    if (wb->len == 0) {
+        return;
+    }
+
+    size_t first = inode->i_size / BLOCK_SIZE;
+    size_t count =
+        (inode->i_size + wb->len + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+    reservation_credit = wb->reserved;
+    size_t allocated = inode_blocks_alloc(inode, first, count);
+    ALWAYS_ASSERT(allocated == count, "inode_flush: reserved blocks missing");
+    ALWAYS_ASSERT(reservation_credit == 0,
+                  "inode_flush: blocks reserved but not used");
+    wb->reserved = 0;
+
+    size_t done = 0;
+    while (done < wb->len) {
+        size_t pos = inode->i_size + done;
+        size_t block_offset = pos % BLOCK_SIZE;
+        size_t run;
+        int bnum = inode_block_map(inode, pos / BLOCK_SIZE, &run);
+        size_t chunk = run * BLOCK_SIZE - block_offset;
+        if (chunk > wb->len - done) {
+            chunk = wb->len - done;
+        }
+
+        memcpy(data_run_get_for_write(bnum, block_offset, chunk),
+               wb->data + done, chunk);
+        done += chunk;
+    }
+
+    inode->i_size += wb->len;
+    journal_log(inode, sizeof(*inode));
+    write_buffer_clear(wb);
+}
+
+/**
+ * Flush the write-back buffers of every file.
+ */
+void state_write_back(void) {
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (!atomic_load(&write_buffers[i].dirty)) {
+            continue;
+        }
+
+        journal_start();
+        tfs_rwlock_wrlock(__FUNCTION__, &inode_lock[i]);
+        inode_flush(&inode_table[i]);
+        tfs_rwlock_unlock(__FUNCTION__, &inode_lock[i]);
+        journal_stop(false);
+    }
+}
+
+/**
+ * Free all the data blocks of an inode and set its size to 0, discarding its
+ * write-back buffer.
+ *
+ * Input:
+ *   - inode: the inode (the caller must hold its lock for writing, or
+ *     otherwise have exclusive access to it)
+ */
+void inode_truncate(inode_t *inode) {
+    write_buffer_clear(&write_buffers[inode - inode_table]);
+
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->i_direct[i] != -1) {
+            data_block_free(inode->i_direct[i]);
+        }
+    }
+    if (inode->i_indirect != -1) {
+        pointer_block_free(inode->i_indirect, 1);
+    }
+    if (inode->i_double_indirect != -1) {
+        pointer_block_free(inode->i_double_indirect, 2);
+    }
+
+    inode_clear_blocks(inode);
+    inode->i_size = 0;
+    journal_log(inode, sizeof(*inode));
+}
+
+/**
+ * Obtain the data a file or symbolic link keeps in its inode.
+ *
+ * The caller must hold the inode's lock (for reading, at least).
+ *
+ * Returns the inline data (i_size bytes), or NULL if the data is in blocks.
+ */
+void const *inode_inline_get(inode_t const *inode) {
+    return inode->i_inline ? inode->i_inline_data : NULL;
+}
+
+/**
+ * Write to the data a file or symbolic link keeps in its inode, which takes
+ * neither a data block nor an access to one.
+ *
+ * Input:
+ *   - inode: the inode (the caller must hold its lock for writing, or
+ *     otherwise have exclusive access to it)
+ *   - buffer: contents to write
+ *   - len: length of the contents
+ *   - offset: where the write goes (a gap before it reads as zeros)
+ *
+ * Returns 0 if the write was done inline, -1 otherwise (and then the data
+ * has to move to a block with inode_inline_spill before it is written).
+ *
+ * Possible errors:
+ *   - The data is not inline, or would not fit in the inode.
+ */
+int inode_inline_write(inode_t *inode, void const *buffer, size_t len,
+                       size_t offset) {
+    if (!inode->i_inline || offset > INODE_INLINE_SIZE ||
+        len > INODE_INLINE_SIZE - offset) {
+        return -1;
+    }
+
+    memcpy(inode->i_inline_data + offset, buffer, len);
+    if (offset + len > inode->i_size) {
+        inode->i_size = offset + len;
+    }
+    journal_log(inode, sizeof(*inode));
+    return 0;
+}
+
+/**
+ * Move the data a file or symbolic link keeps in its inode to its first
+ * block, so that it can grow past INODE_INLINE_SIZE.
+ *
+ * Input:
+ *   - inode: the inode (the caller must hold its lock for writing, or
+ *     otherwise have exclusive access to it)
+ *
+ * Returns 0 if the data is in blocks (now or already), -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int inode_inline_spill(inode_t *inode) {
+    if (!inode->i_inline) {
+        return 0;
+    }
+
+    if (inode->i_size > 0) {
+        if (inode_blocks_alloc(inode, 0, 1) == 0) {
+            return -1;
+        }
+        size_t run;
+        int bnum = inode_block_map(inode, 0, &run);
+        memcpy(data_block_get_for_write(bnum, false), inode->i_inline_data,
+               inode->i_size);
+    }
+
+    inode->i_inline = false;
+    memset(inode->i_inline_data, 0, sizeof(inode->i_inline_data));
+    journal_log(inode, sizeof(*inode));
+    return 0;
+}
+
+/**
+ * Obtain the directory entry stored in a given slot of a directory.
+ *
+ * Only the block holding the slot is accessed.
+ */
+static dir_entry_t *dir_slot_entry(inode_t *inode, int slot) {
+    int bnum = inode_block_get(inode, (size_t)slot / DIR_ENTRIES_PER_BLOCK,
+                               false);
+    ALWAYS_ASSERT(bnum != -1, "dir_slot_entry: directory block missing");
+
+    dir_entry_t *dir_entry = (dir_entry_t *)metadata_block_get(bnum);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_slot_entry: directory must have a data block");
+    return &dir_entry[(size_t)slot % DIR_ENTRIES_PER_BLOCK];
+}
+
+/**
+ * Build the index of a directory from the entries stored in its blocks.
+ *
+ * Returns the index, or NULL if there is no memory for it.
+ */
+static dir_index_t *dir_index_load(inode_t *inode) {
+    dir_index_t *index = dir_index_create();
+    if (index == NULL) {
+        return NULL;
+    }
+
+    // push the empty slots from the last one, so the lowest is handed out first
+    for (size_t b = inode->i_size / BLOCK_SIZE; b > 0; b--) {
+        int bnum = inode_block_get(inode, b - 1, false);
+        ALWAYS_ASSERT(bnum != -1, "dir_index_load: directory block missing");
+        dir_entry_t *dir_entry = (dir_entry_t *)metadata_block_get(bnum);
+
+        for (size_t i = DIR_ENTRIES_PER_BLOCK; i > 0; i--) {
+            int slot = (int)((b - 1) * DIR_ENTRIES_PER_BLOCK + i - 1);
+            int ret = dir_entry[i - 1].d_inumber == -1
+                          ? dir_index_push_free(index, slot)
+                          : dir_index_insert(
+                                index, dir_index_hash(dir_entry[i - 1].d_name),
+                                slot);
+            if (ret == -1) {
+                dir_index_destroy(index);
+                return NULL;
+            }
+        }
+    }
+    return index;
+}
+
+/**
+ * Obtain the index of a directory, building it if this is the first time it
+ * is used since the image was mounted.
+ *
+ * The caller must hold the directory inode's lock (for reading, at least);
+ * concurrent readers may both build the index, but only one of them installs
+ * it.
+ *
+ * Returns the index, or NULL if the directory was removed (or there is no
+ * memory to build its index).
+ */
+static dir_index_t *dir_index_get(inode_t *inode, int inum) {
+    dir_index_t *index = dir_indexes[inum];
+    if (index == NULL) {
+        dir_index_t *loaded = dir_index_load(inode);
+        if (loaded == NULL) {
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong(&dir_indexes[inum], &index,
+                                           loaded)) {
+            index = loaded;
+        } else {
+            dir_index_destroy(loaded); // another reader got there first
+        }
+    }
+    return index == DIR_REMOVED ? NULL : index;
+}
+
+/**
+ * Locate the slot holding a given name in a directory.
+ *
+ * Only the blocks holding slots whose names have the same hash are accessed,
+ * so the cost does not depend on the size of the directory.
+ *
+ * The caller must hold the directory inode's lock.
+ *
+ * Input:
+ *   - inode: the directory's inode
+ *   - inum: directory inumber
+ *   - sub_name: sub file name
+ *   - hash: dir_index_hash(sub_name)
+ *   - entry: set to the entry stored in the slot, if found
+ *
+ * Returns the slot, or -1 if the directory has no entry for sub_name.
+ */
+static int dir_find_slot(inode_t *inode, int inum, char const *sub_name,
+                         uint32_t hash, dir_entry_t **entry) {
+    size_t cursor = 0;
+    int slot;
+    while ((slot = dir_index_next(dir_indexes[inum], hash, &cursor)) != -1) {
+        dir_entry_t *candidate = dir_slot_entry(inode, slot);
+        if (strncmp(candidate->d_name, sub_name, MAX_FILE_NAME) == 0) {
+            *entry = candidate;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * Input:
+ *   - inumber: directory inumber
+ *   - sub_name: sub file name
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ */
+int clear_dir_entry(int inum, char const *sub_name) {
+	inode_t *inode = inode_get(inum);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    uint32_t hash = dir_index_hash(sub_name);
+    tfs_rwlock_wrlock(__FUNCTION__, &inode_lock[inum]);
+    dir_entry_t *entry;
+    int slot = dir_index_get(inode, inum) == NULL
+                   ? -1 // directory was removed
+                   : dir_find_slot(inode, inum, sub_name, hash, &entry);
+    if (slot == -1) {
+        tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+        return -1; // sub_name not found
+    }
+
+    entry->d_inumber = -1;
+    memset(entry->d_name, 0, MAX_FILE_NAME);
+    journal_log(entry, sizeof(*entry));
+    dir_index_remove(dir_indexes[inum], hash, slot);
+    // cannot fail: the free list had room for every slot when it was created
+    dir_index_push_free(dir_indexes[inum], slot);
+    tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+    return 0;
+}
+
+/**
+ * Store the inumber for a sub file in a directory.
+ *
+ * If every entry of the directory is taken, a new block of entries is added
+ * to it.
+ *
+ * Input:
+ *   - inumber: directory inumber
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Directory is full and cannot grow (no free data blocks, or maximum file
+ *     size reached).
+ */
+int add_dir_entry(int inum, char const *sub_name, int sub_inumber) {
+	inode_t *inode = inode_get(inum);
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        return -1; // invalid sub_name
+    }
+
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    tfs_rwlock_wrlock(__FUNCTION__, &inode_lock[inum]);
+    if (dir_index_get(inode, inum) == NULL) {
+        tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+        return -1; // directory was removed
+    }
+
+    // Takes an empty entry (growing the directory if needed) and fills it
+    int slot = dir_index_pop_free(dir_indexes[inum]);
+    if (slot == -1) {
+        if (dir_grow(inode, inum) == -1) {
+            tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+            return -1; // no space for entry
+        }
+        slot = dir_index_pop_free(dir_indexes[inum]);
+    }
+    if (dir_index_insert(dir_indexes[inum], dir_index_hash(sub_name), slot) ==
+        -1) {
+        dir_index_push_free(dir_indexes[inum], slot);
+        tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+        return -1; // no memory for the index
+    }
+
+    dir_entry_t *entry = dir_slot_entry(inode, slot);
+    entry->d_inumber = sub_inumber;
+    strncpy(entry->d_name, sub_name, MAX_FILE_NAME - 1);
+    entry->d_name[MAX_FILE_NAME - 1] = '\0';
+    journal_log(entry, sizeof(*entry));
+    tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+    return 0;
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Input:
+ *   - inum: directory inumber
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
  *
  * Possible errors:
  *   - inode is not a directory inode.
  *   - Directory does not contain a file named sub_name.
  */
 int find_in_dir(int inum, char const *sub_name) {
-	inode_t const *inode = inode_get(inum);
+	inode_t *inode = inode_get(inum);
     ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
     ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
 
-    insert_delay(); // simulate storage access delay to inode with inumber
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
+    uint32_t hash = dir_index_hash(sub_name);
+    tfs_rwlock_rdlock(__FUNCTION__, &inode_lock[inum]);
+    if (dir_index_get(inode, inum) == NULL) {
+        tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+        return -1; // directory was removed
+    }
+    dir_entry_t *entry;
+    int slot = dir_find_slot(inode, inum, sub_name, hash, &entry);
+    int sub_inumber = slot == -1 ? -1 : entry->d_inumber;
+    tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+    return sub_inumber;
+}
+
+/**
+ * Obtain a copy of the entries of a directory.
+ *
+ * Input:
+ *   - inum: directory inumber
+ *   - entries: set to an array with the entries in use, to be freed by the
+ *     caller
+ *   - count: set to the number of entries
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode (or was removed).
+ *   - malloc failure.
+ */
+int dir_list(int inum, dir_entry_t **entries, size_t *count) {
+    inode_t *inode = inode_get(inum);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1;
+    }
 
     tfs_rwlock_rdlock(__FUNCTION__, &inode_lock[inum]);
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            int sub_inumber = dir_entry[i].d_inumber;
-            tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
-            return sub_inumber;
+    dir_index_t *index = dir_index_get(inode, inum);
+    // (one extra entry, so that empty directories do not need malloc(0))
+    dir_entry_t *copy = index == NULL ? NULL
+                                      : malloc((index->count + 1) *
+                                               sizeof(dir_entry_t));
+    if (copy == NULL) {
+        tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t b = 0; b < inode->i_size / BLOCK_SIZE; b++) {
+        int bnum = inode_block_get(inode, b, false);
+        ALWAYS_ASSERT(bnum != -1, "dir_list: directory block missing");
+        dir_entry_t const *dir_entry =
+            (dir_entry_t const *)metadata_block_get(bnum);
+        for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+            if (dir_entry[i].d_inumber != -1) {
+                ALWAYS_ASSERT(n < index->count, "dir_list: index out of date");
+                copy[n++] = dir_entry[i];
+            }
         }
+    }
     tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
-    return -1; // entry not found
+
+    *entries = copy;
+    *count = n;
+    return 0;
+}
+
+/**
+ * Mark a directory as removed, if it has no entries.
+ *
+ * Once removed, no entries can be added to the directory, and lookups in it
+ * find nothing; the inode itself must still be deleted with inode_delete.
+ *
+ * Input:
+ *   - inum: directory inumber
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode (or was already removed).
+ *   - Directory is not empty.
+ */
+int dir_remove_if_empty(int inum) {
+    inode_t *inode = inode_get(inum);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    tfs_rwlock_wrlock(__FUNCTION__, &inode_lock[inum]);
+    dir_index_t *index = dir_index_get(inode, inum);
+    if (index == NULL || index->count != 0) {
+        tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+        return -1;
+    }
+    dir_index_destroy(index);
+    dir_indexes[inum] = DIR_REMOVED;
+    tfs_rwlock_unlock(__FUNCTION__, &inode_lock[inum]);
+    return 0;
+}
+
+/**
+ * Allocate a run of consecutive data blocks, in a single search of
+ * free_blocks: the first free block found, and as many of the free blocks
+ * right after it as requested.
+ *
+ * Input:
+ *   - max: most blocks to allocate (at least 1)
+ *   - count: set to the number of blocks allocated
+ *
+ * Returns the number of the first block if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks (other than those reserved for write-back buffers).
+ */
+int data_block_alloc_run(size_t max, size_t *count) {
+    size_t credit = reservation_credit < max ? reservation_credit : max;
+    reservation_credit -= credit;
+    size_t wanted = credit + blocks_reserve_some(max - credit);
+    if (wanted == 0) {
+        *count = 0;
+        return -1;
+    }
+
+    // free blocks are guaranteed to exist, but a search racing with frees
+    // may miss them
+    ssize_t first;
+    do {
+        bitmap_scan_t scan;
+        first = bitmap_alloc_run(&free_blocks, wanted, count, &scan);
+        bitmap_scan_access(&free_blocks, &scan);
+    } while (first == -1);
+
+    // what was reserved for blocks that were not free next to the run goes
+    // back where it came from
+    size_t unused = wanted - *count;
+    size_t unused_credit = unused < credit ? unused : credit;
+    reservation_credit += unused_credit;
+    atomic_fetch_add(&unreserved_blocks, unused - unused_credit);
+
+    size_t first_word = (size_t)first / BITMAP_WORD_BITS;
+    size_t last_word = ((size_t)first + *count - 1) / BITMAP_WORD_BITS;
+    for (size_t word = first_word; word <= last_word; word++) {
+        journal_log_word(&free_blocks_words[word]);
+    }
+    atomic_fetch_sub(free_block_count, *count);
+    journal_log_word(free_block_count);
+    return (int)first;
 }
 
 /**
@@ -467,36 +1817,33 @@ int find_in_dir(int inum, char const *sub_name) {
  * Returns block number/index if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No free data blocks.
+ *   - No free data blocks (other than those reserved for write-back buffers).
  */
 int data_block_alloc(void) {
-    tfs_rwlock_rdlock(__FUNCTION__, &freeblocks_rwl);
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
-
-        if (free_blocks[i] == FREE) {
-            tfs_rwlock_unlock(__FUNCTION__, &freeblocks_rwl);
-            tfs_rwlock_wrlock(__FUNCTION__, &freeblocks_rwl);
+    size_t count;
+    return data_block_alloc_run(1, &count);
+}
 
-            if (free_blocks[i] == FREE) {
-                free_blocks[i] = TAKEN;
-                tfs_rwlock_unlock(__FUNCTION__, &freeblocks_rwl);
-                return (int)i;
-            } else {
-                tfs_rwlock_unlock(__FUNCTION__, &freeblocks_rwl);
-                tfs_rwlock_rdlock(__FUNCTION__, &freeblocks_rwl);
-            }
-        }
-    }
-    tfs_rwlock_unlock(__FUNCTION__, &freeblocks_rwl);
-    return -1;
+/**
+ * Return a data block to free_blocks.
+ */
+static void data_block_release(int block_number) {
+    atomic_store(&block_pins[block_number], 0);
+
+    bool was_taken = bitmap_free(&free_blocks, (size_t)block_number);
+    ALWAYS_ASSERT(was_taken, "data_block_free: block already freed");
+    journal_log_bit(free_blocks_words, (size_t)block_number);
+    atomic_fetch_add(free_block_count, 1);
+    journal_log_word(free_block_count);
+    atomic_fetch_add(&unreserved_blocks, 1);
 }
 
 /**
  * Free a data block.
  *
+ * If the block is pinned by a view, it only becomes free (and can be reused)
+ * when the last view is released.
+ *
  * Input:
  *   - block_number: the block number/index
  */
@@ -504,13 +1851,79 @@ void data_block_free(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    // simulate storage access delay to free_blocks
+    device_access(DEVICE_METADATA, BITMAP_ADDRESS(block_number));
+
+    unsigned pins =
+        atomic_fetch_or(&block_pins[block_number], BLOCK_FREE_PENDING);
+    ALWAYS_ASSERT((pins & BLOCK_FREE_PENDING) == 0,
+                  "data_block_free: block already freed");
+    if (pins == 0) {
+        data_block_release(block_number);
+    }
+}
 
-    free_blocks[block_number] = FREE;
+/**
+ * Keep a data block from being reused until data_block_unpin is called.
+ *
+ * The block must belong to a file whose inode lock is held by the caller.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_pin(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_pin: invalid block number");
+    atomic_fetch_add(&block_pins[block_number], 1);
+}
+
+/**
+ * Release a pin taken with data_block_pin, freeing the block if it was freed
+ * in the meantime and this was its last pin.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_unpin(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_unpin: invalid block number");
+
+    unsigned pins = atomic_fetch_sub(&block_pins[block_number], 1);
+    ALWAYS_ASSERT((pins & ~BLOCK_FREE_PENDING) != 0,
+                  "data_block_unpin: block not pinned");
+    if (pins == (BLOCK_FREE_PENDING | 1)) {
+        data_block_release(block_number);
+    }
+}
+
+/**
+ * Bring a data block into the buffer cache ahead of its use.
+ *
+ * A read of the block that comes before the prefetch completes still goes to
+ * the device on its own.
+ *
+ * Input:
+ *   - block_number: the block number/index (which may have been freed
+ *     meanwhile, as only its place in the buffer cache is affected)
+ */
+void data_block_prefetch(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_prefetch: invalid block number");
+
+    size_t key = BLOCK_KEY(block_number);
+    if (!buffer_cache_contains(key)) {
+        device_access(DEVICE_READ, key);
+        buffer_cache_insert(key);
+    }
 }
 
 /**
- * Obtain a pointer to the contents of a given block.
+ * Obtain a block's worth of zeros, standing for a hole in a file.
+ */
+void const *state_zero_block(void) { return zero_block; }
+
+/**
+ * Obtain a pointer to the contents of a given block, to read from it.
  *
  * Input:
  *   - block_number: the block number/index
@@ -521,38 +1934,145 @@ void *data_block_get(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to block
+    storage_access(BLOCK_KEY(block_number), DEVICE_READ);
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
+/**
+ * Obtain a pointer to the contents of a given block, to write file data to
+ * it.
+ *
+ * Writes go through to the device. Overwriting part of a block that is not
+ * cached has to read it first. File data is not journaled: it reaches the
+ * image file when the operation is committed (before its metadata).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - whole_block: whether the whole block is about to be overwritten
+ *
+ * Returns a pointer to the first byte of the block.
+ */
+void *data_block_get_for_write(int block_number, bool whole_block) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_get_for_write: invalid block number");
+
+    if (!whole_block) {
+        storage_access(BLOCK_KEY(block_number), DEVICE_READ);
+    } else {
+        buffer_cache_insert(BLOCK_KEY(block_number));
+    }
+    device_access(DEVICE_WRITE, BLOCK_KEY(block_number));
+    void *block = &fs_data[(size_t)block_number * BLOCK_SIZE];
+    image_dirty_data(&image, block, BLOCK_SIZE);
+    return block;
+}
+
+/**
+ * Obtain a pointer to bytes held in consecutive data blocks (an extent of a
+ * file), to read them with a single copy.
+ *
+ * Input:
+ *   - first_block: the first block number/index
+ *   - offset: where the bytes start in the first block
+ *   - len: number of bytes
+ *
+ * Returns a pointer to the first byte.
+ */
+void *data_run_get(int first_block, size_t offset, size_t len) {
+    size_t blocks = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (size_t i = 0; i < blocks; i++) {
+        data_block_get(first_block + (int)i);
+    }
+    return &fs_data[(size_t)first_block * BLOCK_SIZE + offset];
+}
+
+/**
+ * Obtain a pointer to bytes held in consecutive data blocks (an extent of a
+ * file), to overwrite them with a single copy.
+ *
+ * Input:
+ *   - first_block: the first block number/index
+ *   - offset: where the bytes start in the first block
+ *   - len: number of bytes
+ *
+ * Returns a pointer to the first byte.
+ */
+void *data_run_get_for_write(int first_block, size_t offset, size_t len) {
+    size_t end = offset + len;
+    for (size_t pos = 0; pos < end; pos += BLOCK_SIZE) {
+        bool whole_block = pos >= offset && pos + BLOCK_SIZE <= end;
+        data_block_get_for_write(first_block + (int)(pos / BLOCK_SIZE),
+                                 whole_block);
+    }
+    return &fs_data[(size_t)first_block * BLOCK_SIZE + offset];
+}
+
+/**
+ * Pop a handle from the stack of free file handles.
+ *
+ * Returns the handle, or -1 if the stack is empty.
+ */
+static int free_handle_pop(void) {
+    uint64_t head = atomic_load(&free_handles_head);
+    for (;;) {
+        int top = (int)(head & UINT32_MAX) - 1;
+        if (top == -1) {
+            return -1;
+        }
+
+        // a stale next is harmless: the update count makes the CAS fail
+        uint64_t next = (uint32_t)(atomic_load(&free_handles_next[top]) + 1);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+        if (atomic_compare_exchange_weak(&free_handles_head, &head,
+                                         new_head)) {
+            return top;
+        }
+    }
+}
+
+/**
+ * Push a handle onto the stack of free file handles.
+ */
+static void free_handle_push(int fhandle) {
+    uint64_t head = atomic_load(&free_handles_head);
+    uint64_t new_head;
+    do {
+        atomic_store(&free_handles_next[fhandle],
+                     (int)(head & UINT32_MAX) - 1);
+        new_head = ((head >> 32) + 1) << 32 | (uint32_t)(fhandle + 1);
+    } while (!atomic_compare_exchange_weak(&free_handles_head, &head,
+                                           new_head));
+}
+
 /**
  * Add a new entry to the open file table.
  *
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
+ *   - append: whether writes go to the end of the file
  *
  * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
  *   - No space in open file table for a new open file.
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    
-    tfs_mutex_lock(__FUNCTION__, &free_open_file_entries_mutex);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            tfs_mutex_lock(__FUNCTION__, &open_file_table[i].lock);
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            tfs_mutex_unlock(__FUNCTION__, &open_file_table[i].lock);
-            tfs_mutex_unlock(__FUNCTION__, &free_open_file_entries_mutex);
-            return i;
-        }
-    }
-    tfs_mutex_unlock(__FUNCTION__, &free_open_file_entries_mutex);
-    return -1;
+int add_to_open_file_table(int inumber, size_t offset, bool append) {
+    int fhandle = free_handle_pop();
+    if (fhandle == -1) {
+        return -1;
+    }
+
+    // the entry is not reachable by other threads until it is marked as taken
+    open_file_table[fhandle].of_inumber = inumber;
+    open_file_table[fhandle].of_offset = offset;
+    open_file_table[fhandle].of_append = append;
+    open_file_table[fhandle].of_ra_next = offset / BLOCK_SIZE;
+    open_file_table[fhandle].of_ra_window = 0;
+    open_file_table[fhandle].of_ra_end = 0;
+    atomic_fetch_add(&inode_open_count[inumber], 1);
+    atomic_store(&free_open_file_entries[fhandle], TAKEN);
+    return fhandle;
 }
 
 /**
@@ -560,17 +2080,24 @@ int add_to_open_file_table(int inumber, size_t offset) {
  *
  * Input:
  *   - fhandle: file handle to free/close
+ *
+ * Returns 0 if successful, -1 if the handle is not open.
  */
-void remove_from_open_file_table(int fhandle) {
-    tfs_mutex_lock(__FUNCTION__, &free_open_file_entries_mutex);
+int remove_from_open_file_table(int fhandle) {
     ALWAYS_ASSERT(valid_file_handle(fhandle),
                   "remove_from_open_file_table: file handle must be valid");
 
-    ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
-                  "remove_from_open_file_table: file handle must be taken");
+    // only one of several threads closing the same handle succeeds
+    allocation_state_t taken = TAKEN;
+    if (!atomic_compare_exchange_strong(&free_open_file_entries[fhandle],
+                                        &taken, FREE)) {
+        return -1;
+    }
 
-    free_open_file_entries[fhandle] = FREE;
-    tfs_mutex_unlock(__FUNCTION__, &free_open_file_entries_mutex);
+    atomic_fetch_sub(&inode_open_count[open_file_table[fhandle].of_inumber],
+                     1);
+    free_handle_push(fhandle);
+    return 0;
 }
 
 /**
@@ -582,17 +2109,7 @@ void remove_from_open_file_table(int fhandle) {
  * Returns 1 if inumber is open, 0 otherwise
  */
 int is_open(int inumber) {
-    tfs_mutex_lock(__FUNCTION__, &free_open_file_entries_mutex);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == TAKEN) {
-			if (open_file_table[i].of_inumber == inumber) {
-                tfs_mutex_unlock(__FUNCTION__, &free_open_file_entries_mutex);
-				return 1;
-			}
-        }
-    }
-    tfs_mutex_unlock(__FUNCTION__, &free_open_file_entries_mutex);
-    return 0;
+    return atomic_load(&inode_open_count[inumber]) > 0;
 }
 
 /**
@@ -609,7 +2126,7 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
         return NULL;
     }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
+    if (atomic_load(&free_open_file_entries[fhandle]) != TAKEN) {
         return NULL;
     }
 
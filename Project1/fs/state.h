@@ -20,6 +20,15 @@ typedef struct {
 
 typedef enum { T_FILE, T_DIRECTORY, T_SOFTLINK} inode_type;
 
+/**
+ * Extent: consecutive blocks of a file held in consecutive data blocks
+ */
+typedef struct {
+    size_t e_file_block; // first block of the file
+    int e_block;         // data block holding it (-1 if the extent is unused)
+    size_t e_length;     // number of blocks
+} extent_t;
+
 /**
  * Inode
  */
@@ -27,7 +36,15 @@ typedef struct {
     inode_type i_node_type;
 
     size_t i_size;
-    int i_data_block;
+    int i_direct[INODE_DIRECT_BLOCKS]; // first blocks of the file
+    int i_indirect;        // block holding further block numbers
+    int i_double_indirect; // block holding numbers of indirect blocks
+    // the longest runs of blocks allocated together, so that they are mapped
+    // without following the pointers above (which still hold every block)
+    extent_t i_extents[INODE_EXTENTS];
+    // tiny files and symbolic links keep their data here (without any block)
+    bool i_inline;
+    char i_inline_data[INODE_INLINE_SIZE];
 	int hard_link_count; // contador de hardlinks (comeca a 1)
 
     // in a more complete FS, more fields could exist here
@@ -41,30 +58,68 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    bool of_append; // writes always go to the end of the file
+
+    // readahead (see tfs_read): block where the next sequential read starts,
+    // number of blocks prefetched ahead of it, and first block not prefetched
+    size_t of_ra_next;
+    size_t of_ra_window;
+    size_t of_ra_end;
+
     pthread_mutex_t lock;
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
+bool state_mounted(void);
 
 size_t state_block_size(void);
+size_t state_max_file_size(void);
 
 pthread_rwlock_t *get_inode_lock(int inum);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+int inode_block_get(inode_t *inode, size_t file_block, bool alloc);
+int inode_block_map(inode_t *inode, size_t file_block, size_t *run);
+size_t inode_blocks_alloc(inode_t *inode, size_t first, size_t count);
+void inode_truncate(inode_t *inode);
+
+void const *inode_inline_get(inode_t const *inode);
+int inode_inline_write(inode_t *inode, void const *buffer, size_t len,
+                       size_t offset);
+int inode_inline_spill(inode_t *inode);
+
+size_t inode_file_size(inode_t const *inode);
+bool inode_write_back_pending(int inumber);
+int inode_buffer_append(inode_t *inode, void const *buffer, size_t len,
+                        size_t offset);
+void inode_buffer_read(inode_t const *inode, void *buffer, size_t len,
+                       size_t offset);
+void inode_flush(inode_t *inode);
+void state_write_back(void);
 
 int clear_dir_entry(int inum, char const *sub_name);
 int add_dir_entry(int inum, char const *sub_name, int sub_inumber);
 int find_in_dir(int inum, char const *sub_name);
+int dir_remove_if_empty(int inum);
+int dir_list(int inum, dir_entry_t **entries, size_t *count);
 
 int data_block_alloc(void);
+int data_block_alloc_run(size_t max, size_t *count);
 void data_block_free(int block_number);
 void *data_block_get(int block_number);
-
-int add_to_open_file_table(int inumber, size_t offset);
-void remove_from_open_file_table(int fhandle);
+void *data_block_get_for_write(int block_number, bool whole_block);
+void *data_run_get(int first_block, size_t offset, size_t len);
+void *data_run_get_for_write(int first_block, size_t offset, size_t len);
+void data_block_pin(int block_number);
+void data_block_unpin(int block_number);
+void data_block_prefetch(int block_number);
+void const *state_zero_block(void);
+
+int add_to_open_file_table(int inumber, size_t offset, bool append);
+int remove_from_open_file_table(int fhandle);
 int is_open(int inumber);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
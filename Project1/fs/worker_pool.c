@@ -0,0 +1,141 @@
+#include "worker_pool.h"
+#include "config.h"
+#include "locks.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Number of threads for a pool doing CPU-bound work: one per online core, up
+ * to WORKER_POOL_MAX_THREADS.
+ */
+size_t worker_pool_default_size(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        return 1;
+    }
+    if (cores > WORKER_POOL_MAX_THREADS) {
+        return WORKER_POOL_MAX_THREADS;
+    }
+    return (size_t)cores;
+}
+
+static void *worker_thread(void *arg) {
+    worker_pool_t *pool = arg;
+
+    tfs_mutex_lock(__FUNCTION__, &pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->stopping) {
+            tfs_cond_wait(__FUNCTION__, &pool->work_cond, &pool->lock);
+        }
+        if (pool->head == NULL) {
+            break; // stopping, and nothing left to do
+        }
+
+        worker_task_t *task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        tfs_mutex_unlock(__FUNCTION__, &pool->lock);
+
+        task->fn(task->arg);
+        free(task);
+
+        tfs_mutex_lock(__FUNCTION__, &pool->lock);
+    }
+    tfs_mutex_unlock(__FUNCTION__, &pool->lock);
+    return NULL;
+}
+
+/**
+ * Start a worker pool.
+ *
+ * Input:
+ *   - thread_count: number of threads (at least 1)
+ *
+ * Returns the pool, or NULL in case of error.
+ *
+ * Possible errors:
+ *   - malloc failure.
+ *   - Threads cannot be created.
+ */
+worker_pool_t *worker_pool_create(size_t thread_count) {
+    if (thread_count == 0) {
+        return NULL;
+    }
+
+    worker_pool_t *pool =
+        malloc(sizeof(worker_pool_t) + thread_count * sizeof(pthread_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    tfs_mutex_init(__FUNCTION__, &pool->lock);
+    tfs_cond_init(__FUNCTION__, &pool->work_cond);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->stopping = false;
+
+    for (pool->thread_count = 0; pool->thread_count < thread_count;
+         pool->thread_count++) {
+        if (pthread_create(&pool->threads[pool->thread_count], NULL,
+                           worker_thread, pool) != 0) {
+            worker_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * Run the tasks still queued, then stop the threads and free the pool.
+ */
+void worker_pool_destroy(worker_pool_t *pool) {
+    tfs_mutex_lock(__FUNCTION__, &pool->lock);
+    pool->stopping = true;
+    tfs_cond_broadcast(__FUNCTION__, &pool->work_cond);
+    tfs_mutex_unlock(__FUNCTION__, &pool->lock);
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    tfs_cond_destroy(__FUNCTION__, &pool->work_cond);
+    tfs_mutex_destroy(__FUNCTION__, &pool->lock);
+    free(pool);
+}
+
+/**
+ * Queue a task.
+ *
+ * Input:
+ *   - pool: the pool
+ *   - fn: function to run in one of the pool's threads
+ *   - arg: argument for fn
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure.
+ */
+int worker_pool_submit(worker_pool_t *pool, void (*fn)(void *), void *arg) {
+    worker_task_t *task = malloc(sizeof(worker_task_t));
+    if (task == NULL) {
+        return -1;
+    }
+    task->next = NULL;
+    task->fn = fn;
+    task->arg = arg;
+
+    tfs_mutex_lock(__FUNCTION__, &pool->lock);
+    if (pool->tail == NULL) {
+        pool->head = task;
+    } else {
+        pool->tail->next = task;
+    }
+    pool->tail = task;
+    tfs_cond_signal(__FUNCTION__, &pool->work_cond);
+    tfs_mutex_unlock(__FUNCTION__, &pool->lock);
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct worker_task {
+    struct worker_task *next;
+    void (*fn)(void *arg);
+    void *arg;
+} worker_task_t;
+
+/**
+ * Fixed set of threads running the tasks submitted to them, in submission
+ * order.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; // a task was queued, or the pool is stopping
+
+    worker_task_t *head;
+    worker_task_t *tail;
+    bool stopping;
+
+    size_t thread_count;
+    pthread_t threads[];
+} worker_pool_t;
+
+size_t worker_pool_default_size(void);
+
+worker_pool_t *worker_pool_create(size_t thread_count);
+void worker_pool_destroy(worker_pool_t *pool);
+
+int worker_pool_submit(worker_pool_t *pool, void (*fn)(void *), void *arg);
+
+#endif // WORKER_POOL_H
@@ -0,0 +1,67 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#define OPENS 2000
+
+char const path[] = "/f1";
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// time taken to open (and close) an existing file OPENS times
+static double time_opens(void) {
+    double start = now();
+    for (int i = 0; i < OPENS; i++) {
+        int fhandle = tfs_open(path, 0);
+        assert(fhandle != -1);
+        assert(tfs_close(fhandle) != -1);
+    }
+    return now() - start;
+}
+
+static double run(size_t buffer_cache_size, tfs_cache_stats_t *stats) {
+    tfs_params params = tfs_default_params();
+    params.buffer_cache_size = buffer_cache_size;
+    assert(tfs_init(&params) != -1);
+
+    int fhandle = tfs_open(path, TFS_O_CREAT);
+    assert(fhandle != -1);
+    assert(tfs_write(fhandle, "abc", 3) == 3);
+    assert(tfs_close(fhandle) != -1);
+
+    // warm up, then check that only hits follow
+    time_opens();
+    tfs_cache_stats_t warm;
+    tfs_cache_stats(&warm);
+    double elapsed = time_opens();
+    tfs_cache_stats(stats);
+    stats->hits -= warm.hits;
+    stats->misses -= warm.misses;
+
+    assert(tfs_destroy() != -1);
+    return elapsed;
+}
+
+int main() {
+    tfs_cache_stats_t uncached_stats, cached_stats;
+    double uncached = run(0, &uncached_stats);
+    double cached = run(64, &cached_stats);
+
+    // without a cache, every access misses
+    assert(uncached_stats.hits == 0);
+    assert(uncached_stats.misses > 0);
+
+    // with one, the warm path never goes to storage (and is much faster)
+    assert(cached_stats.misses == 0);
+    assert(cached_stats.hits == uncached_stats.misses);
+    assert(cached * 2 < uncached);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
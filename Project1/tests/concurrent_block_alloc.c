@@ -0,0 +1,67 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 8
+#define BLOCKS_PER_FILE 100
+#define BLOCK_SIZE 1024
+
+/*
+ * Every thread fills its own file; if two threads were ever handed the same
+ * block, one of the files would end up with the other's contents.
+ */
+void *fill_file(void *arg) {
+    int id = *(int *)arg;
+    char path[16];
+    snprintf(path, sizeof(path), "/f%d", id);
+
+    char block[BLOCK_SIZE];
+    memset(block, 'A' + id, sizeof(block));
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < BLOCKS_PER_FILE; i++) {
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    }
+    assert(tfs_close(f) != -1);
+
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, fill_file, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/f%d", i);
+
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        char buffer[BLOCK_SIZE];
+        for (int b = 0; b < BLOCKS_PER_FILE; b++) {
+            assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+            for (size_t j = 0; j < sizeof(buffer); j++) {
+                assert(buffer[j] == 'A' + i);
+            }
+        }
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 8
+#define FILES_PER_THREAD 2
+#define ROUNDS 4
+
+/*
+ * Threads keep creating and removing their own files. Inumbers freed by one
+ * thread must be reusable by the others, even once the inode table is full.
+ */
+void *create_files(void *arg) {
+    int id = *(int *)arg;
+
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            char path[16];
+            snprintf(path, sizeof(path), "/t%d_%d", id, i);
+
+            int f = tfs_open(path, TFS_O_CREAT);
+            assert(f != -1);
+            assert(tfs_write(f, path, strlen(path)) == strlen(path));
+            assert(tfs_close(f) != -1);
+        }
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            char path[16];
+            snprintf(path, sizeof(path), "/t%d_%d", id, i);
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    // exactly enough inodes for the root directory and every file
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 1 + THREADS * FILES_PER_THREAD;
+    assert(tfs_init(&params) != -1);
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, create_files, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // every inode is free again, and can be taken by a single thread
+    for (int i = 0; i < THREADS * FILES_PER_THREAD; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/m%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/full", TFS_O_CREAT) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE (600 * 1024 + 123)
+
+int main() {
+    char src_path[64];
+    snprintf(src_path, sizeof(src_path), "/tmp/tfs_bulk_%d", getpid());
+
+    char *contents = malloc(FILE_SIZE);
+    assert(contents != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (char)(i * 7 + i / 1000);
+    }
+    FILE *fp = fopen(src_path, "w");
+    assert(fp != NULL);
+    assert(fwrite(contents, 1, FILE_SIZE, fp) == FILE_SIZE);
+    assert(fclose(fp) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 1024;
+    assert(tfs_init(&params) != -1);
+
+    // overwrites what was there
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "old contents", 12) == 12);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_copy_from_external_fs(src_path, "/big") != -1);
+
+    char *buffer = malloc(FILE_SIZE + 1);
+    assert(buffer != NULL);
+    f = tfs_open("/big", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE + 1) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    // a second copy does not fit, and is left empty
+    assert(tfs_copy_from_external_fs(src_path, "/big2") == -1);
+    f = tfs_open("/big2", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    // its blocks were given back
+    assert(tfs_unlink("/big") != -1);
+    assert(tfs_copy_from_external_fs(src_path, "/big2") != -1);
+
+    assert(tfs_destroy() != -1);
+    assert(unlink(src_path) == 0);
+    free(contents);
+    free(buffer);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
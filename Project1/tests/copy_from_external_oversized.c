@@ -8,7 +8,10 @@ int main() {
     char *path_copied_file = "/f1";
     char *path_src = "tests/oversized_file.txt";
 
-    assert(tfs_init(NULL) != -1);
+    // root directory + one data block: the source file does not fit
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 2;
+    assert(tfs_init(&params) != -1);
 
     int f;
 
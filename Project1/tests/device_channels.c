@@ -0,0 +1,101 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define THREADS 4
+#define MS (1000 * 1000ul)
+#define READ_NS (10 * MS)
+
+char const *paths[THREADS] = {"/f1", "/f2", "/f3", "/f4"};
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 * MS + (unsigned long)ts.tv_nsec;
+}
+
+void *read_file(void *arg) {
+    char const *path = arg;
+    int fhandle = tfs_open(path, 0);
+    assert(fhandle != -1);
+    char buffer[100];
+    assert(tfs_read(fhandle, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(buffer[0] == path[2]);
+    assert(tfs_close(fhandle) != -1);
+    return NULL;
+}
+
+/*
+ * Time taken by THREADS threads to each read a block of its own file, from a
+ * device where only reads take time.
+ */
+static unsigned long time_reads(size_t channels, size_t queue_depth,
+                                tfs_device_stats_t *stats) {
+    tfs_params params = tfs_default_params();
+    params.buffer_cache_size = 0; // every access goes to the device
+    params.device = tfs_device_params(TFS_DEVICE_NONE);
+    params.device.read_ns = READ_NS;
+    params.device.channels = channels;
+    params.device.queue_depth = queue_depth;
+    assert(tfs_init(&params) != -1);
+
+    // files written in whole blocks, so nothing is read from the device
+    char block[1024];
+    for (int i = 0; i < THREADS; i++) {
+        memset(block, paths[i][2], sizeof(block));
+        int fhandle = tfs_open(paths[i], TFS_O_CREAT);
+        assert(fhandle != -1);
+        assert(tfs_write(fhandle, block, sizeof(block)) == sizeof(block));
+        assert(tfs_close(fhandle) != -1);
+    }
+
+    unsigned long start = now_ns();
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, read_file,
+                              (void *)paths[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    unsigned long elapsed = now_ns() - start;
+
+    tfs_device_stats(stats);
+    assert(stats->submitted > 0);
+    assert(stats->submitted == stats->completed);
+    assert(tfs_destroy() != -1);
+    return elapsed;
+}
+
+int main() {
+    tfs_device_stats_t stats;
+
+    // each file's block is in its own channel: the reads overlap
+    unsigned long elapsed = time_reads(THREADS, THREADS, &stats);
+    assert(elapsed < 2 * READ_NS);
+    assert(stats.throttled == 0);
+
+    // a single channel serves them one at a time
+    elapsed = time_reads(1, THREADS, &stats);
+    assert(elapsed >= THREADS * READ_NS);
+
+    // and so does a queue with room for a single access
+    elapsed = time_reads(THREADS, 1, &stats);
+    assert(elapsed >= THREADS * READ_NS);
+    assert(stats.throttled > 0);
+
+    // devices need at least a channel and room for an access
+    tfs_params params = tfs_default_params();
+    params.device.channels = 0;
+    assert(tfs_init(&params) == -1);
+    params = tfs_default_params();
+    params.device.queue_depth = 0;
+    assert(tfs_init(&params) == -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MS (1000 * 1000ul)
+
+char const path[] = "/f1";
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 * MS + (unsigned long)ts.tv_nsec;
+}
+
+// a device that only takes time for one kind of access
+static void init(unsigned long read_ns, unsigned long write_ns,
+                 unsigned long metadata_ns) {
+    tfs_params params = tfs_default_params();
+    params.buffer_cache_size = 0; // every access goes to the device
+    params.device = tfs_device_params(TFS_DEVICE_NONE);
+    params.device.read_ns = read_ns;
+    params.device.write_ns = write_ns;
+    params.device.metadata_ns = metadata_ns;
+    assert(tfs_init(&params) != -1);
+}
+
+int main() {
+    // faster devices have lower latencies
+    tfs_device_params_t none = tfs_device_params(TFS_DEVICE_NONE);
+    tfs_device_params_t nvme = tfs_device_params(TFS_DEVICE_NVME);
+    tfs_device_params_t ssd = tfs_device_params(TFS_DEVICE_SATA_SSD);
+    tfs_device_params_t hdd = tfs_device_params(TFS_DEVICE_HDD);
+    assert(none.read_ns == 0 && none.write_ns == 0 && none.metadata_ns == 0);
+    assert(0 < nvme.read_ns && nvme.read_ns < ssd.read_ns &&
+           ssd.read_ns < hdd.read_ns);
+    assert(0 < nvme.write_ns && nvme.write_ns < ssd.write_ns &&
+           ssd.write_ns < hdd.write_ns);
+
+    // only metadata is slow: looking up a file pays for it, not writing it
+    init(0, 0, 2 * MS);
+    unsigned long start = now_ns();
+    int fhandle = tfs_open(path, TFS_O_CREAT);
+    assert(fhandle != -1);
+    assert(now_ns() - start >= 2 * MS);
+
+    char buffer[100] = {0};
+    assert(tfs_write(fhandle, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_destroy() != -1);
+
+    // only writes are slow (and each whole block written goes to the device)
+    init(0, 2 * MS, 0);
+    fhandle = tfs_open(path, TFS_O_CREAT);
+    assert(fhandle != -1);
+    char block[1024] = {0};
+    start = now_ns();
+    assert(tfs_write(fhandle, block, sizeof(block)) == sizeof(block));
+    assert(tfs_write(fhandle, block, sizeof(block)) == sizeof(block));
+    assert(now_ns() - start >= 4 * MS);
+
+    // reading is not
+    start = now_ns();
+    assert(tfs_pread(fhandle, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(now_ns() - start < 2 * MS);
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILES 20
+
+void path_of(int i, char *path, size_t size) {
+    snprintf(path, size, "/file%d", i);
+}
+
+void check_contents(char const *path) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    char buffer[16] = {0};
+    assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(path));
+    assert(strcmp(buffer, path) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    char path[16];
+    for (int i = 0; i < FILES; i++) {
+        path_of(i, path, sizeof(path));
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, path, strlen(path)) == strlen(path));
+        assert(tfs_close(f) != -1);
+    }
+
+    // every name resolves to its own file
+    for (int i = 0; i < FILES; i++) {
+        path_of(i, path, sizeof(path));
+        check_contents(path);
+    }
+
+    // prefixes and extensions of existing names are different names
+    assert(tfs_open("/file", 0) == -1);
+    assert(tfs_open("/file10x", 0) == -1);
+
+    // remove every other entry
+    for (int i = 0; i < FILES; i += 2) {
+        path_of(i, path, sizeof(path));
+        assert(tfs_unlink(path) != -1);
+        assert(tfs_open(path, 0) == -1);
+        assert(tfs_unlink(path) == -1);
+    }
+    for (int i = 1; i < FILES; i += 2) {
+        path_of(i, path, sizeof(path));
+        check_contents(path);
+    }
+
+    // the freed entries can be reused
+    for (int i = 0; i < FILES; i += 2) {
+        path_of(i, path, sizeof(path));
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, path, strlen(path)) == strlen(path));
+        assert(tfs_close(f) != -1);
+    }
+    for (int i = 0; i < FILES; i++) {
+        path_of(i, path, sizeof(path));
+        check_contents(path);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
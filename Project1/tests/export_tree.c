@@ -0,0 +1,98 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BIG_SIZE (100 * 1024 + 7)
+
+static void write_file(char const *path, void const *contents, size_t len) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, len) == len);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_host_file(char const *path, void const *contents,
+                            size_t len) {
+    FILE *fp = fopen(path, "r");
+    assert(fp != NULL);
+    char *buffer = malloc(len + 1);
+    assert(buffer != NULL);
+    assert(fread(buffer, 1, len + 1, fp) == len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(fclose(fp) == 0);
+    free(buffer);
+}
+
+int main() {
+    char root[64];
+    snprintf(root, sizeof(root), "/tmp/tfs_export_%d", getpid());
+
+    char *big = malloc(BIG_SIZE);
+    assert(big != NULL);
+    for (size_t i = 0; i < BIG_SIZE; i++) {
+        big[i] = (char)(i * 13);
+    }
+    char zeros[1500] = {0};
+    zeros[1499] = 'z';
+
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_mkdir("/box") != -1);
+    assert(tfs_mkdir("/box/sub") != -1);
+    write_file("/box/big", big, BIG_SIZE);
+    write_file("/box/sub/small", "small", 5);
+    write_file("/box/empty", "", 0);
+    assert(tfs_sym_link("/box/big", "/box/link") != -1);
+
+    // a file with a hole
+    int f = tfs_open("/box/sub/hole", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "z", 1, 1499) == 1);
+    assert(tfs_close(f) != -1);
+
+    // a single file
+    char path[128];
+    snprintf(path, sizeof(path), "%s_single", root);
+    assert(tfs_copy_to_external_fs("/box/big", path) != -1);
+    check_host_file(path, big, BIG_SIZE);
+    assert(unlink(path) == 0);
+    assert(tfs_copy_to_external_fs("/box/missing", path) == -1);
+    assert(tfs_copy_to_external_fs("/box/big", "/nonexistent_dir/f") == -1);
+
+    // the whole tree
+    assert(tfs_export_tree("/box/", root, NULL, NULL) == 0);
+    snprintf(path, sizeof(path), "%s/big", root);
+    check_host_file(path, big, BIG_SIZE);
+    snprintf(path, sizeof(path), "%s/empty", root);
+    check_host_file(path, "", 0);
+    snprintf(path, sizeof(path), "%s/sub/small", root);
+    check_host_file(path, "small", 5);
+    snprintf(path, sizeof(path), "%s/sub/hole", root);
+    check_host_file(path, zeros, sizeof(zeros));
+    snprintf(path, sizeof(path), "%s/link", root);
+    struct stat st;
+    assert(lstat(path, &st) == -1); // skipped
+
+    assert(tfs_export_tree("/missing", root, NULL, NULL) == -1);
+    assert(tfs_export_tree("/box/big", root, NULL, NULL) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    // clean up the OS' file system
+    char const *files[] = {"big", "empty", "sub/small", "sub/hole"};
+    for (size_t i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+        assert(unlink(path) == 0);
+    }
+    snprintf(path, sizeof(path), "%s/sub", root);
+    assert(rmdir(path) == 0);
+    assert(rmdir(root) == 0);
+    free(big);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
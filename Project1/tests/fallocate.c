@@ -0,0 +1,91 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE 1024
+#define BLOCKS 64
+
+char const path1[] = "/f1";
+char const path2[] = "/f2";
+
+// whether a range of a file is held in consecutive blocks
+static int contiguous(int fhandle, size_t offset, size_t len) {
+    tfs_view_t views[BLOCKS];
+    ssize_t count = tfs_view(fhandle, offset, len, views, BLOCKS);
+    assert(count > 0);
+    int ret = 1;
+    for (ssize_t i = 1; i < count; i++) {
+        if (views[i].block != views[i - 1].block + 1 ||
+            (char const *)views[i].data !=
+                (char const *)views[i - 1].data + views[i - 1].len) {
+            ret = 0;
+        }
+    }
+    tfs_view_release(views, (size_t)count);
+    return ret;
+}
+
+int main() {
+    char buffer[BLOCKS * BLOCK_SIZE];
+    char zeros[BLOCKS * BLOCK_SIZE] = {0};
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 4 * BLOCKS;
+    assert(tfs_init(&params) != -1);
+
+    // preallocated blocks are consecutive, read as zeros, and make the file
+    // grow
+    int f1 = tfs_open(path1, TFS_O_CREAT);
+    assert(f1 != -1);
+    assert(tfs_fallocate(f1, 0, sizeof(buffer)) == 0);
+    assert(tfs_read(f1, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, zeros, sizeof(buffer)) == 0);
+    assert(contiguous(f1, 0, sizeof(buffer)));
+
+    // writing over them allocates nothing more
+    memset(buffer, 'a', sizeof(buffer));
+    assert(tfs_pwrite(f1, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(contiguous(f1, 0, sizeof(buffer)));
+
+    // files growing side by side get a run of blocks per write
+    int f2 = tfs_open(path2, TFS_O_CREAT);
+    assert(f2 != -1);
+    for (size_t i = 0; i < 4; i++) {
+        memset(buffer, (int)('b' + i), sizeof(buffer));
+        assert(tfs_write(f2, buffer, 8 * BLOCK_SIZE) == 8 * BLOCK_SIZE);
+        assert(tfs_write(f1, buffer, 8 * BLOCK_SIZE) == 8 * BLOCK_SIZE);
+        assert(contiguous(f2, i * 8 * BLOCK_SIZE, 8 * BLOCK_SIZE));
+    }
+    for (size_t i = 0; i < 4; i++) {
+        assert(tfs_pread(f2, buffer, 8 * BLOCK_SIZE, i * 8 * BLOCK_SIZE) ==
+               8 * BLOCK_SIZE);
+        for (size_t j = 0; j < 8 * BLOCK_SIZE; j++) {
+            assert(buffer[j] == (char)('b' + i));
+        }
+    }
+
+    // a range past the end of the file leaves a hole before it
+    assert(tfs_fallocate(f2, 40 * BLOCK_SIZE, 100) == 0);
+    assert(tfs_pread(f2, buffer, sizeof(buffer), 32 * BLOCK_SIZE) ==
+           8 * BLOCK_SIZE + 100);
+    assert(memcmp(buffer, zeros, 8 * BLOCK_SIZE + 100) == 0);
+
+    // invalid ranges and handles
+    assert(tfs_fallocate(f2, 0, 0) == -1);
+    assert(tfs_fallocate(f2, (size_t)-1, 1) == -1);
+    assert(tfs_fallocate(-1, 0, 1) == -1);
+
+    // running out of space does not make the file grow
+    assert(tfs_fallocate(f2, 0, 8 * BLOCKS * BLOCK_SIZE) == -1);
+    assert(tfs_pread(f2, buffer, sizeof(buffer), 40 * BLOCK_SIZE) == 100);
+
+    assert(tfs_close(f1) != -1);
+    assert(tfs_close(f2) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
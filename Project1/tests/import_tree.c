@@ -0,0 +1,101 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILES_PER_DIR 10
+
+char const *dirs[] = {"", "/sub", "/sub/deeper"};
+#define DIR_COUNT (sizeof(dirs) / sizeof(dirs[0]))
+
+char const long_name[] = "a_name_that_is_too_long_for_tecnicofs_to_hold";
+
+pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+int failures;
+char failed_dest[128];
+
+void on_failure(char const *source_path, char const *dest_path, void *arg) {
+    (void)source_path;
+    assert(arg == &failures);
+    assert(pthread_mutex_lock(&failures_lock) == 0);
+    failures++;
+    snprintf(failed_dest, sizeof(failed_dest), "%s", dest_path);
+    assert(pthread_mutex_unlock(&failures_lock) == 0);
+}
+
+int main() {
+    char root[64];
+    snprintf(root, sizeof(root), "/tmp/tfs_tree_%d", getpid());
+
+    // build the tree in the OS' file system
+    char path[256];
+    for (size_t d = 0; d < DIR_COUNT; d++) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[d]);
+        assert(mkdir(path, 0755) == 0);
+        for (int i = 0; i < FILES_PER_DIR; i++) {
+            snprintf(path, sizeof(path), "%s%s/f%d", root, dirs[d], i);
+            FILE *fp = fopen(path, "w");
+            assert(fp != NULL);
+            assert(fprintf(fp, "contents of %s/f%d", dirs[d], i) > 0);
+            assert(fclose(fp) == 0);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%s", root, long_name);
+    FILE *fp = fopen(path, "w");
+    assert(fp != NULL);
+    assert(fclose(fp) == 0);
+    snprintf(path, sizeof(path), "%s/link", root);
+    assert(symlink("f0", path) == 0);
+
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_mkdir("/imp") != -1); // existing directories are reused
+
+    assert(tfs_import_tree(root, "/imp/", on_failure, &failures) == 1);
+    assert(failures == 1);
+    snprintf(path, sizeof(path), "/imp/%s", long_name);
+    assert(strcmp(failed_dest, path) == 0);
+
+    char expected[128];
+    char buffer[128];
+    for (size_t d = 0; d < DIR_COUNT; d++) {
+        for (int i = 0; i < FILES_PER_DIR; i++) {
+            snprintf(path, sizeof(path), "/imp%s/f%d", dirs[d], i);
+            int f = tfs_open(path, 0);
+            assert(f != -1);
+            ssize_t len = tfs_read(f, buffer, sizeof(buffer));
+            assert(tfs_close(f) != -1);
+
+            int expected_len = snprintf(expected, sizeof(expected),
+                                        "contents of %s/f%d", dirs[d], i);
+            assert(len == expected_len);
+            assert(memcmp(buffer, expected, (size_t)len) == 0);
+        }
+    }
+    assert(tfs_open("/imp/link", 0) == -1); // skipped
+
+    assert(tfs_import_tree("/nonexistent_dir", "/imp", NULL, NULL) == -1);
+    assert(tfs_import_tree(root, "imp", NULL, NULL) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    // clean up the OS' file system
+    snprintf(path, sizeof(path), "%s/%s", root, long_name);
+    assert(unlink(path) == 0);
+    snprintf(path, sizeof(path), "%s/link", root);
+    assert(unlink(path) == 0);
+    for (size_t d = DIR_COUNT; d > 0; d--) {
+        for (int i = 0; i < FILES_PER_DIR; i++) {
+            snprintf(path, sizeof(path), "%s%s/f%d", root, dirs[d - 1], i);
+            assert(unlink(path) == 0);
+        }
+        snprintf(path, sizeof(path), "%s%s", root, dirs[d - 1]);
+        assert(rmdir(path) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TINY 40
+#define SMALL 200
+
+char const path1[] = "/f1";
+char const path2[] = "/f2";
+char const link_path[] = "/l1";
+
+static unsigned long device_accesses(void) {
+    tfs_device_stats_t stats;
+    tfs_device_stats(&stats);
+    return stats.submitted;
+}
+
+// device accesses taken by reading a whole file
+static unsigned long read_accesses(int fhandle, char const *expected,
+                                   size_t len) {
+    char buffer[SMALL];
+    unsigned long before = device_accesses();
+    assert(tfs_pread(fhandle, buffer, sizeof(buffer), 0) == (ssize_t)len);
+    unsigned long accesses = device_accesses() - before;
+    assert(memcmp(buffer, expected, len) == 0);
+    return accesses;
+}
+
+int main() {
+    char tiny[TINY];
+    char small[SMALL];
+    memset(tiny, 't', sizeof(tiny));
+    memset(small, 's', sizeof(small));
+
+    tfs_params params = tfs_default_params();
+    params.buffer_cache_size = 0; // every access goes to the device
+    params.device = tfs_device_params(TFS_DEVICE_NONE);
+    params.max_block_count = 2; // one for the root directory
+    assert(tfs_init(&params) != -1);
+
+    // tiny files and symbolic links take no data block
+    int f1 = tfs_open(path1, TFS_O_CREAT);
+    assert(f1 != -1);
+    assert(tfs_write(f1, tiny, sizeof(tiny)) == sizeof(tiny));
+    int f2 = tfs_open(path2, TFS_O_CREAT);
+    assert(f2 != -1);
+    assert(tfs_write(f2, tiny, sizeof(tiny)) == sizeof(tiny));
+    assert(tfs_sym_link(path1, link_path) != -1);
+    int f3 = tfs_open(link_path, 0);
+    assert(f3 != -1);
+    assert(read_accesses(f3, tiny, sizeof(tiny)) > 0);
+    assert(tfs_close(f3) != -1);
+
+    // writes past the end leave a gap of zeros, while they fit
+    char expected2[SMALL] = {0};
+    memcpy(expected2, tiny, sizeof(tiny));
+    memcpy(expected2 + sizeof(tiny) + 4, "end", 3);
+    size_t len2 = sizeof(tiny) + 7;
+    assert(tfs_pwrite(f2, "end", 3, sizeof(tiny) + 4) == 3);
+    read_accesses(f2, expected2, len2);
+
+    // views of them get a copy of the data
+    tfs_view_t views[2];
+    assert(tfs_view(f1, 4, sizeof(tiny), views, 2) == 1);
+    assert(views[0].len == sizeof(tiny) - 4 && views[0].block == -1);
+    assert(memcmp(views[0].data, tiny, views[0].len) == 0);
+    tfs_view_release(views, 1);
+
+    // the first file to grow past its inode takes the only free block, and
+    // the other one stays as it was
+    char expected1[SMALL];
+    memcpy(expected1, tiny, sizeof(tiny));
+    memcpy(expected1 + sizeof(tiny), small, sizeof(small) - sizeof(tiny));
+    assert(tfs_write(f1, small, sizeof(small) - sizeof(tiny)) ==
+           sizeof(small) - sizeof(tiny));
+    assert(tfs_flush(f1) != -1);
+    assert(tfs_write(f2, small, sizeof(small)) == -1);
+
+    // reading a tiny file takes half the device accesses of reading one held
+    // in a block (the inode, without the block)
+    unsigned long block_accesses = read_accesses(f1, expected1, SMALL);
+    unsigned long inline_accesses = read_accesses(f2, expected2, len2);
+    assert(inline_accesses > 0 && 2 * inline_accesses <= block_accesses);
+
+    // truncating the grown file frees its block, and starts it over inline
+    assert(tfs_close(f1) != -1);
+    f1 = tfs_open(path1, TFS_O_TRUNC);
+    assert(f1 != -1);
+    assert(tfs_write(f1, tiny, sizeof(tiny)) == sizeof(tiny));
+    read_accesses(f1, tiny, sizeof(tiny));
+    assert(tfs_pwrite(f2, small, SMALL - len2, len2) ==
+           (ssize_t)(SMALL - len2));
+    memcpy(expected2 + len2, small, SMALL - len2);
+    read_accesses(f2, expected2, SMALL);
+
+    assert(tfs_close(f1) != -1);
+    assert(tfs_close(f2) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include "fs/image.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define FILES_PER_THREAD 10
+#define INODES 32
+#define BLOCKS 16
+#define PAYLOAD_SIZE 3000 // too large to be inline: held in data blocks
+
+char image_path[64];
+
+static char *read_image(size_t *size) {
+    FILE *fp = fopen(image_path, "r");
+    assert(fp != NULL);
+    assert(fseek(fp, 0, SEEK_END) == 0);
+    long len = ftell(fp);
+    assert(len > 0);
+    rewind(fp);
+
+    char *bytes = malloc((size_t)len);
+    assert(bytes != NULL);
+    assert(fread(bytes, 1, (size_t)len, fp) == (size_t)len);
+    assert(fclose(fp) == 0);
+    *size = (size_t)len;
+    return bytes;
+}
+
+void *create_and_unlink(void *arg) {
+    int id = *(int *)arg;
+    char name[MAX_FILE_NAME];
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        snprintf(name, sizeof(name), "/t%d_%d", id, i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        if (i % 2 == 1) {
+            assert(tfs_unlink(name) != -1);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    char payload[PAYLOAD_SIZE];
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (char)('a' + i % 26);
+    }
+
+    snprintf(image_path, sizeof(image_path), "/tmp/tfs_journal_%d", getpid());
+    unlink(image_path);
+
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+    params.max_inode_count = INODES;
+    params.max_block_count = BLOCKS;
+
+    // a checkpointed image, with only the root directory
+    assert(tfs_init(&params) != -1);
+    assert(tfs_destroy() != -1);
+    size_t size;
+    char *checkpointed = read_image(&size);
+
+    // a process that changes the image and dies without tfs_destroy
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+        assert(tfs_mkdir("/d") != -1);
+        int f = tfs_open("/d/f", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, "hello", 5) == 5);
+        assert(tfs_close(f) != -1);
+        f = tfs_open("/d/g", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, payload, sizeof(payload)) == sizeof(payload));
+        assert(tfs_close(f) != -1);
+        // committed along with the data written before it
+        assert(tfs_link("/d/f", "/hard") != -1);
+        assert(tfs_sym_link("/d/f", "/soft") != -1);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // crash: the journal and the file data reached the disk, but none of the
+    // metadata changes the journal describes did (they are only written in
+    // place at checkpoints)
+    char *crashed = read_image(&size);
+    superblock_t const *sb = (superblock_t const *)crashed;
+    assert(memcmp(crashed + sb->inode_bitmap_offset,
+                  checkpointed + sb->inode_bitmap_offset,
+                  sb->data_offset - sb->inode_bitmap_offset) == 0);
+    free(crashed);
+    free(checkpointed);
+
+    // mounting replays the journal
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/d") == -1);
+    char const *paths[] = {"/d/f", "/hard", "/soft"};
+    char buffer[10];
+    for (size_t i = 0; i < 3; i++) {
+        int f = tfs_open(paths[i], TFS_O_APPEND);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == 0); // at the end (5)
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_unlink("/hard") != -1);
+
+    // the data the replayed metadata refers to is there
+    char contents[PAYLOAD_SIZE];
+    int g = tfs_open("/d/g", 0);
+    assert(g != -1);
+    assert(tfs_read(g, contents, sizeof(contents)) == sizeof(contents));
+    assert(memcmp(contents, payload, sizeof(payload)) == 0);
+    assert(tfs_close(g) != -1);
+    assert(tfs_unlink("/d/g") != -1);
+
+    // the count of free blocks is replayed with the block bitmap: every block
+    // but those of the root directory and /d can be allocated (one of them
+    // for the indirect block of /big)
+    int big = tfs_open("/big", TFS_O_CREAT);
+    assert(big != -1);
+    size_t free_len = (BLOCKS - 3) * params.block_size;
+    assert(tfs_fallocate(big, 0, free_len) == 0);
+    assert(tfs_fallocate(big, free_len, 1) == -1);
+    assert(tfs_close(big) != -1);
+    assert(tfs_unlink("/big") != -1);
+
+    // the inumbers the process had reserved, but not used, are free again:
+    // only the root directory, /d, /d/f and /soft are in use
+    char name[MAX_FILE_NAME];
+    int created = 0;
+    for (;;) {
+        snprintf(name, sizeof(name), "/n%d", created);
+        int f = tfs_open(name, TFS_O_CREAT);
+        if (f == -1) {
+            break;
+        }
+        assert(tfs_close(f) != -1);
+        created++;
+    }
+    assert(created == INODES - 4);
+    for (int i = 0; i < created; i++) {
+        snprintf(name, sizeof(name), "/n%d", i);
+        assert(tfs_unlink(name) != -1);
+    }
+
+    // group commits of concurrent creations and removals
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, create_and_unlink, &ids[i]) ==
+               0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/hard", 0) == -1);
+    int f = tfs_open("/d/f", 0);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            snprintf(name, sizeof(name), "/t%d_%d", t, i);
+            f = tfs_open(name, 0);
+            assert((f != -1) == (i % 2 == 0));
+            if (f != -1) {
+                assert(tfs_close(f) != -1);
+            }
+        }
+    }
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(image_path) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILES 2000
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = FILES + 1;
+    assert(tfs_init(&params) != -1);
+
+    // far more entries than fit in one directory block
+    char path[16];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/box%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    // the inode table is full, but the names are all there
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/box%d", i);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/box%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/box%d", i);
+        assert(tfs_open(path, 0) == -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "fs/locks.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 4
+
+char const path[] = "/f1";
+
+void *write_file(void *arg) {
+    (void)arg;
+    char contents[100];
+    memset(contents, 'x', sizeof(contents));
+
+    for (int i = 0; i < 50; i++) {
+        int fhandle = tfs_open(path, TFS_O_CREAT);
+        assert(fhandle != -1);
+        assert(tfs_pwrite(fhandle, contents, sizeof(contents), 0) ==
+               sizeof(contents));
+        assert(tfs_close(fhandle) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, write_file, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    int dumped = tfs_lock_profile_dump(out);
+
+#ifdef TFS_LOCK_PROFILE
+    // every call site that took a lock has its own line
+    assert(dumped == 0);
+    rewind(out);
+    char line[1024];
+    int sites = 0;
+    unsigned long acquires = 0;
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (line[0] == ' ') {
+            continue;
+        }
+        sites++;
+        unsigned long count;
+        char *counts = strstr(line, ": ");
+        assert(counts != NULL);
+        assert(sscanf(counts, ": %lu acquires", &count) == 1);
+        acquires += count;
+    }
+    assert(sites > 1);
+    assert(acquires >= THREADS * 50);
+
+    // after a reset, nothing was acquired
+    tfs_lock_profile_reset();
+    assert(freopen(NULL, "w+", out) != NULL);
+    assert(tfs_lock_profile_dump(out) == 0);
+    rewind(out);
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (line[0] != ' ') {
+            assert(strstr(line, ": 0 acquires, 0 contended") != NULL);
+        }
+    }
+#else
+    // built without profiling: nothing to print
+    assert(dumped == -1);
+    assert(ftell(out) == 0);
+#endif
+    fclose(out);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define THREADS 4
+#define HANDLES_PER_THREAD 5000
+
+char const path[] = "/f1";
+
+void *open_handles(void *arg) {
+    int *handles = arg;
+    for (int i = 0; i < HANDLES_PER_THREAD; i++) {
+        handles[i] = tfs_open(path, 0);
+        assert(handles[i] != -1);
+    }
+    return NULL;
+}
+
+void *close_handles(void *arg) {
+    int *handles = arg;
+    for (int i = 0; i < HANDLES_PER_THREAD; i++) {
+        assert(tfs_close(handles[i]) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = THREADS * HANDLES_PER_THREAD;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(f) == -1);
+
+    static int handles[THREADS][HANDLES_PER_THREAD];
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, open_handles, handles[i]) ==
+               0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // the table is full, and no handle was given out twice
+    assert(tfs_open(path, 0) == -1);
+    char *seen = calloc(THREADS * HANDLES_PER_THREAD, 1);
+    assert(seen != NULL);
+    for (int i = 0; i < THREADS; i++) {
+        for (int j = 0; j < HANDLES_PER_THREAD; j++) {
+            int h = handles[i][j];
+            assert(h >= 0 && h < THREADS * HANDLES_PER_THREAD && !seen[h]);
+            seen[h] = 1;
+        }
+    }
+    free(seen);
+
+    // an open file cannot be unlinked
+    assert(tfs_unlink(path) == -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, close_handles, handles[i]) ==
+               0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(tfs_unlink(path) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
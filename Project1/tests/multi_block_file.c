@@ -0,0 +1,69 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// spans the direct, indirect and double indirect blocks of the inode
+#define FILE_SIZE (300 * 1024)
+#define CHUNK_SIZE (777)
+
+char const path[] = "/f1";
+
+int main() {
+    char *contents = malloc(FILE_SIZE);
+    char *buffer = malloc(FILE_SIZE);
+    assert(contents != NULL && buffer != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init(NULL) != -1);
+
+    // write in chunks that do not line up with block boundaries
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t done = 0; done < FILE_SIZE; done += CHUNK_SIZE) {
+        size_t len = FILE_SIZE - done < CHUNK_SIZE ? FILE_SIZE - done
+                                                   : CHUNK_SIZE;
+        assert(tfs_write(f, contents + done, len) == len);
+    }
+    assert(tfs_close(f) != -1);
+
+    // read everything back in one go
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_read(f, buffer, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    // appending continues where the file ends
+    f = tfs_open(path, TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, "!", 1) == 1);
+    assert(tfs_close(f) != -1);
+
+    // truncating releases the blocks, so the file can be written again
+    for (int i = 0; i < 3; i++) {
+        f = tfs_open(path, TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+
+    // unlinking releases them as well
+    assert(tfs_unlink(path) != -1);
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+    free(contents);
+    free(buffer);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+char const file_contents[] = "message in a box";
+char const file_path[] = "/tenant/box/messages";
+
+void write_contents(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_close(f) != -1);
+}
+
+void assert_contents_ok(char const *path) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    char buffer[sizeof(file_contents)];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, file_contents, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // parent directories must exist
+    assert(tfs_open(file_path, TFS_O_CREAT) == -1);
+    assert(tfs_mkdir("/tenant/box") == -1);
+
+    assert(tfs_mkdir("/tenant") != -1);
+    assert(tfs_mkdir("/tenant") == -1);
+    assert(tfs_mkdir("/tenant/box") != -1);
+
+    write_contents(file_path);
+    assert_contents_ok(file_path);
+    // opening it again goes through the cached directory path
+    assert_contents_ok(file_path);
+
+    // same name in a different directory is a different file
+    assert(tfs_open("/messages", 0) == -1);
+    assert(tfs_open("/tenant/messages", 0) == -1);
+
+    // directories are not files, and files are not directories
+    assert(tfs_open("/tenant/box", 0) == -1);
+    assert(tfs_unlink("/tenant/box") == -1);
+    assert(tfs_open("/tenant/box/messages/x", TFS_O_CREAT) == -1);
+    assert(tfs_mkdir("/tenant/box/messages/x") == -1);
+    assert(tfs_rmdir(file_path) == -1);
+
+    // malformed paths
+    assert(tfs_open("/tenant//box/messages", 0) == -1);
+    assert(tfs_open("/tenant/box/", TFS_O_CREAT) == -1);
+    assert(tfs_rmdir("/") == -1);
+
+    // links across directories
+    assert(tfs_link(file_path, "/hard") != -1);
+    assert(tfs_sym_link(file_path, "/tenant/soft") != -1);
+    assert_contents_ok("/hard");
+    assert_contents_ok("/tenant/soft");
+    assert(tfs_link("/tenant", "/tenant2") == -1);
+
+    // only empty directories can be removed
+    assert(tfs_rmdir("/tenant/box") == -1);
+    assert(tfs_unlink(file_path) != -1);
+    assert(tfs_rmdir("/tenant/box") != -1);
+    assert(tfs_rmdir("/tenant/box") == -1);
+    assert_contents_ok("/hard");
+    assert(tfs_open("/tenant/soft", 0) == -1);
+
+    // the removed directory is not reachable anymore, even through the cache
+    assert(tfs_open(file_path, TFS_O_CREAT) == -1);
+
+    // until it is created again
+    assert(tfs_mkdir("/tenant/box") != -1);
+    assert(tfs_open(file_path, 0) == -1);
+    write_contents(file_path);
+    assert_contents_ok("/tenant/soft");
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
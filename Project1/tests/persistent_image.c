@@ -0,0 +1,93 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE 5000
+
+int main() {
+    char image_path[64];
+    snprintf(image_path, sizeof(image_path), "/tmp/tfs_image_%d", getpid());
+    unlink(image_path);
+
+    char contents[FILE_SIZE];
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    // create an image and fill it
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 32;
+    params.image_path = image_path;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_mkdir("/d") != -1);
+    int f = tfs_open("/d/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_link("/d/f", "/hard") != -1);
+    assert(tfs_sym_link("/d/f", "/soft") != -1);
+
+    // an inode that is freed again
+    f = tfs_open("/tmp", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/tmp") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    // mount it, with other parameters (the image keeps its own geometry)
+    params = tfs_default_params();
+    params.image_path = image_path;
+    assert(tfs_init(&params) != -1);
+
+    char buffer[FILE_SIZE];
+    char const *paths[] = {"/d/f", "/hard", "/soft"};
+    for (size_t i = 0; i < 3; i++) {
+        f = tfs_open(paths[i], 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, contents, sizeof(buffer)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/tmp", 0) == -1);
+    assert(tfs_mkdir("/d") == -1);
+
+    // every inode not in use can be allocated again: 32 minus the root,
+    // /d, /d/f and /soft
+    char name[MAX_FILE_NAME];
+    int created = 0;
+    for (int i = 0; i < 32; i++) {
+        snprintf(name, sizeof(name), "/d/n%d", i);
+        f = tfs_open(name, TFS_O_CREAT);
+        if (f == -1) {
+            break;
+        }
+        assert(tfs_close(f) != -1);
+        created++;
+    }
+    assert(created == 32 - 4);
+
+    // the directory keeps working after its index is rebuilt
+    assert(tfs_unlink("/d/f") != -1);
+    assert(tfs_unlink("/d/n0") != -1);
+    f = tfs_open("/hard", 0);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    // an existing file that does not hold an image cannot be mounted
+    FILE *fp = fopen(image_path, "w");
+    assert(fp != NULL);
+    assert(fputs("not an image", fp) != EOF);
+    assert(fclose(fp) == 0);
+    assert(tfs_init(&params) == -1);
+
+    assert(unlink(image_path) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
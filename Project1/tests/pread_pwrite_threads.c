@@ -0,0 +1,77 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 8
+#define RANGE_SIZE 4000
+
+char const path[] = "/f1";
+int fhandle;
+
+// every thread writes and reads back its own range, through the same handle
+void *use_range(void *arg) {
+    int id = *(int *)arg;
+    size_t offset = (size_t)id * RANGE_SIZE;
+
+    char contents[RANGE_SIZE];
+    memset(contents, 'a' + id, sizeof(contents));
+    assert(tfs_pwrite(fhandle, contents, sizeof(contents), offset) ==
+           sizeof(contents));
+
+    char buffer[RANGE_SIZE];
+    for (int i = 0; i < 10; i++) {
+        assert(tfs_pread(fhandle, buffer, sizeof(buffer), offset) ==
+               sizeof(buffer));
+        assert(memcmp(buffer, contents, sizeof(buffer)) == 0);
+    }
+
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    fhandle = tfs_open(path, TFS_O_CREAT);
+    assert(fhandle != -1);
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, use_range, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // the handle's offset was left untouched
+    char buffer[RANGE_SIZE];
+    assert(tfs_read(fhandle, buffer, 1) == 1);
+    assert(buffer[0] == 'a');
+
+    // reading past the end of the file
+    size_t size = THREADS * RANGE_SIZE;
+    assert(tfs_pread(fhandle, buffer, sizeof(buffer), size) == 0);
+    assert(tfs_pread(fhandle, buffer, sizeof(buffer), size - 10) == 10);
+
+    // writing past the end leaves a hole that reads as zeros
+    assert(tfs_pwrite(fhandle, "z", 1, size + 5000) == 1);
+    assert(tfs_pread(fhandle, buffer, sizeof(buffer), size) == sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(tfs_pread(fhandle, buffer, sizeof(buffer), size + 5000) == 1);
+    assert(buffer[0] == 'z');
+
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_pread(fhandle, buffer, 1, 0) == -1);
+    assert(tfs_pwrite(fhandle, buffer, 1, 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
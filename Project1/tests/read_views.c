@@ -0,0 +1,95 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_VIEWS 8
+
+int main() {
+    char contents[3000];
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    // the root directory takes one block, so four are left for files
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 5;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+
+    // a range spanning three blocks
+    tfs_view_t views[MAX_VIEWS];
+    ssize_t count = tfs_view(f, 500, 2000, views, MAX_VIEWS);
+    assert(count == 3);
+    size_t offset = 500;
+    for (ssize_t i = 0; i < count; i++) {
+        assert(memcmp(views[i].data, contents + offset, views[i].len) == 0);
+        offset += views[i].len;
+    }
+    assert(offset == 2500);
+    tfs_view_release(views, (size_t)count);
+
+    // limited by the number of views and by the end of the file
+    assert(tfs_view(f, 0, sizeof(contents), views, 1) == 1);
+    assert(views[0].len == 1024);
+    tfs_view_release(views, 1);
+    assert(tfs_view(f, 2900, 1000, views, MAX_VIEWS) == 1);
+    assert(views[0].len == 100);
+    tfs_view_release(views, 1);
+    assert(tfs_view(f, 3000, 1000, views, MAX_VIEWS) == 0);
+
+    // the handle's offset was left untouched (at the end of the write)
+    char buffer[10];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+
+    // the blocks of a deleted file are not reused while pinned
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    count = tfs_view(f, 0, sizeof(contents), views, MAX_VIEWS);
+    assert(count == 3);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/f1") != -1);
+
+    char other[4096];
+    memset(other, 'x', sizeof(other));
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, other, sizeof(other)) == 1024); // one free block
+    offset = 0;
+    for (ssize_t i = 0; i < count; i++) {
+        assert(memcmp(views[i].data, contents + offset, views[i].len) == 0);
+        offset += views[i].len;
+    }
+    tfs_view_release(views, (size_t)count);
+
+    // and they are reused once released
+    assert(tfs_write(f, other, sizeof(other)) == 3 * 1024);
+    assert(tfs_pwrite(f, "z", 1, 6000) == -1); // no space
+    assert(tfs_close(f) != -1);
+
+    // holes read as zeros
+    assert(tfs_unlink("/f2") != -1);
+    f = tfs_open("/f3", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "z", 1, 2000) == 1);
+    count = tfs_view(f, 0, 2001, views, MAX_VIEWS);
+    assert(count == 2);
+    assert(views[0].block == -1 && views[0].len == 1024);
+    for (size_t i = 0; i < views[0].len; i++) {
+        assert(((char const *)views[0].data)[i] == 0);
+    }
+    assert(((char const *)views[1].data)[976] == 'z');
+    tfs_view_release(views, (size_t)count);
+    assert(tfs_close(f) != -1);
+    assert(tfs_view(f, 0, 1, views, MAX_VIEWS) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
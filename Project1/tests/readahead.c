@@ -0,0 +1,95 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCKS 64
+#define BLOCK_SIZE 1024
+#define CHUNK 100
+#define MS (1000 * 1000ul)
+#define READ_NS (1 * MS)
+
+char const path[] = "/f1";
+char image_path[64];
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 * MS + (unsigned long)ts.tv_nsec;
+}
+
+static void mount(void) {
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+    params.block_size = BLOCK_SIZE;
+    params.device = tfs_device_params(TFS_DEVICE_NONE);
+    params.device.read_ns = READ_NS;
+    params.device.channels = 8;
+    params.device.queue_depth = 32;
+    assert(tfs_init(&params) != -1);
+}
+
+// read the whole file from a cold cache, in small chunks
+static unsigned long read_file(int sequential, tfs_cache_stats_t *stats) {
+    mount();
+    int fhandle = tfs_open(path, 0);
+    assert(fhandle != -1);
+
+    tfs_cache_stats_t before;
+    tfs_cache_stats(&before);
+    unsigned long start = now_ns();
+
+    char buffer[CHUNK];
+    for (size_t offset = 0; offset < BLOCKS * BLOCK_SIZE; offset += CHUNK) {
+        ssize_t r = sequential ? tfs_read(fhandle, buffer, CHUNK)
+                               : tfs_pread(fhandle, buffer, CHUNK, offset);
+        assert(r > 0);
+        assert(buffer[0] == (char)('a' + offset / BLOCK_SIZE % 26));
+    }
+
+    unsigned long elapsed = now_ns() - start;
+    tfs_cache_stats(stats);
+    stats->hits -= before.hits;
+    stats->misses -= before.misses;
+
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_destroy() != -1);
+    return elapsed;
+}
+
+int main() {
+    snprintf(image_path, sizeof(image_path), "/tmp/tfs_readahead_%d",
+             getpid());
+    unlink(image_path);
+
+    // a file of many blocks, in an image (so that it is read from a cold
+    // cache after mounting it again)
+    mount();
+    int fhandle = tfs_open(path, TFS_O_CREAT);
+    assert(fhandle != -1);
+    char block[BLOCK_SIZE];
+    for (int i = 0; i < BLOCKS; i++) {
+        memset(block, 'a' + i % 26, sizeof(block));
+        assert(tfs_write(fhandle, block, sizeof(block)) == sizeof(block));
+    }
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_destroy() != -1);
+
+    // positioned reads get no readahead: every block is a miss
+    tfs_cache_stats_t stats;
+    unsigned long without = read_file(0, &stats);
+    assert(stats.misses >= BLOCKS);
+
+    // sequential reads find most blocks already prefetched
+    unsigned long with = read_file(1, &stats);
+    assert(stats.misses < BLOCKS / 2);
+    assert(with * 2 < without);
+
+    assert(unlink(image_path) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+int main() {
+    char const path[] = "/f1";
+
+    char header[] = "HEADER:";
+    char payload[2000];
+    memset(payload, 'p', sizeof(payload));
+    char trailer[] = ":END";
+
+    assert(tfs_init(NULL) != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    struct iovec out[] = {
+        {.iov_base = header, .iov_len = strlen(header)},
+        {.iov_base = NULL, .iov_len = 0},
+        {.iov_base = payload, .iov_len = sizeof(payload)},
+        {.iov_base = trailer, .iov_len = strlen(trailer)},
+    };
+    size_t total = strlen(header) + sizeof(payload) + strlen(trailer);
+    assert(tfs_writev(f, out, 4) == (ssize_t)total);
+    assert(tfs_writev(f, out, 0) == 0);
+    assert(tfs_close(f) != -1);
+
+    // read it back split in different places than it was written
+    f = tfs_open(path, 0);
+    assert(f != -1);
+
+    char first[10];
+    char second[3000];
+    struct iovec in[] = {
+        {.iov_base = first, .iov_len = sizeof(first)},
+        {.iov_base = second, .iov_len = sizeof(second)},
+    };
+    assert(tfs_readv(f, in, 2) == (ssize_t)total);
+    assert(memcmp(first, "HEADER:ppp", sizeof(first)) == 0);
+    size_t rest = total - sizeof(first);
+    for (size_t i = 0; i < rest - strlen(trailer); i++) {
+        assert(second[i] == 'p');
+    }
+    assert(memcmp(second + rest - strlen(trailer), trailer, strlen(trailer)) ==
+           0);
+
+    // at the end of the file
+    assert(tfs_readv(f, in, 2) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_readv(f, in, 2) == -1);
+    assert(tfs_writev(f, out, 4) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
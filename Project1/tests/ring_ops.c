@@ -0,0 +1,139 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define FILES 32
+#define ENTRIES 64
+#define THREADS 8
+#define MS (1000 * 1000ul)
+
+char paths[FILES][16];
+char contents[FILES][1024];
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 * MS + (unsigned long)ts.tv_nsec;
+}
+
+// submit one operation per file, and reap every result (by file)
+static void run_all(tfs_ring_t *ring, tfs_sqe_t *sqes, ssize_t *results) {
+    for (int i = 0; i < FILES; i++) {
+        sqes[i].user_data = &results[i];
+    }
+    assert(tfs_ring_submit(ring, sqes, FILES) == FILES);
+
+    tfs_cqe_t cqes[FILES];
+    size_t reaped = 0;
+    while (reaped < FILES) {
+        reaped += tfs_ring_reap(ring, cqes + reaped, FILES - reaped, 1);
+    }
+    for (int i = 0; i < FILES; i++) {
+        *(ssize_t *)cqes[i].user_data = cqes[i].result;
+    }
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = FILES;
+    params.buffer_cache_size = 0; // every data block read goes to the device
+    params.device = tfs_device_params(TFS_DEVICE_NONE);
+    params.device.read_ns = 2 * MS;
+    params.device.channels = THREADS;
+    params.device.queue_depth = ENTRIES;
+    assert(tfs_init(&params) != -1);
+
+    tfs_ring_t *ring = tfs_ring_create(ENTRIES, THREADS);
+    assert(ring != NULL);
+
+    tfs_sqe_t sqes[FILES];
+    ssize_t results[FILES];
+    int fhandles[FILES];
+
+    // open (creating) every file
+    for (int i = 0; i < FILES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/f%d", i);
+        memset(contents[i], 'a' + i % 26, sizeof(contents[i]));
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_OPEN,
+                              .name = paths[i],
+                              .mode = TFS_O_CREAT};
+    }
+    run_all(ring, sqes, results);
+    for (int i = 0; i < FILES; i++) {
+        assert(results[i] != -1);
+        fhandles[i] = (int)results[i];
+    }
+
+    // write them (at the file offset)
+    for (int i = 0; i < FILES; i++) {
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_WRITE,
+                              .fhandle = fhandles[i],
+                              .buffer = contents[i],
+                              .len = sizeof(contents[i]),
+                              .offset = TFS_OFFSET_CURRENT};
+    }
+    run_all(ring, sqes, results);
+    for (int i = 0; i < FILES; i++) {
+        assert(results[i] == sizeof(contents[i]));
+    }
+
+    // read them back (at offset 0), overlapping the device's latency
+    char buffers[FILES][1024];
+    for (int i = 0; i < FILES; i++) {
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_READ,
+                              .fhandle = fhandles[i],
+                              .buffer = buffers[i],
+                              .len = sizeof(buffers[i]),
+                              .offset = 0};
+    }
+    unsigned long start = now_ns();
+    run_all(ring, sqes, results);
+    unsigned long elapsed = now_ns() - start;
+    assert(elapsed < FILES * 2 * MS / 2);
+    for (int i = 0; i < FILES; i++) {
+        assert(results[i] == sizeof(buffers[i]));
+        assert(memcmp(buffers[i], contents[i], sizeof(buffers[i])) == 0);
+    }
+
+    // close and unlink them
+    for (int i = 0; i < FILES; i++) {
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_CLOSE, .fhandle = fhandles[i]};
+    }
+    run_all(ring, sqes, results);
+    for (int i = 0; i < FILES; i++) {
+        assert(results[i] == 0);
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_UNLINK, .name = paths[i]};
+    }
+    run_all(ring, sqes, results);
+    for (int i = 0; i < FILES; i++) {
+        assert(results[i] == 0);
+        assert(tfs_open(paths[i], 0) == -1);
+    }
+
+    // failures are reported in the completion
+    sqes[0] = (tfs_sqe_t){.op = TFS_OP_UNLINK, .name = "/missing"};
+    assert(tfs_ring_submit(ring, sqes, 1) == 1);
+    tfs_cqe_t cqe;
+    assert(tfs_ring_reap(ring, &cqe, 1, 1) == 1);
+    assert(cqe.result == -1);
+
+    // nothing in flight: reaping does not wait
+    assert(tfs_ring_reap(ring, &cqe, 1, 1) == 0);
+
+    // the ring only takes as many operations as it has entries
+    tfs_sqe_t unlinks[ENTRIES + 1];
+    for (int i = 0; i < ENTRIES + 1; i++) {
+        unlinks[i] = (tfs_sqe_t){.op = TFS_OP_UNLINK, .name = "/missing"};
+    }
+    assert(tfs_ring_submit(ring, unlinks, ENTRIES + 1) == ENTRIES);
+    assert(tfs_ring_submit(ring, unlinks, 1) == 0);
+    tfs_ring_destroy(ring);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
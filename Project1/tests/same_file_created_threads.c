@@ -40,11 +40,12 @@ int main() {
         assert(pthread_create(&thread_id[i], NULL, create_file, NULL) == 0); 
    
     for (int i = 0; i < N_THREADS; i++) 
-        pthread_join(thread_id[i], NULL);
+        pthread_join(thread_id[i], (void **)&fd[i]);
 
     // close the files 
     for(int i = 0; i<N_THREADS; ++i){
         tfs_close(*fd[i]);
+        free(fd[i]);
     }
    
     int f = tfs_open(FILENAME, TFS_O_CREAT);
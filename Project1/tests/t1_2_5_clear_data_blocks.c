@@ -5,7 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 
-uint8_t const file_contents[] = "AAA!";
+// too long to be kept in the inode, so that each file needs a data block
+uint8_t const file_contents[] =
+    "AAA! AAA! AAA! AAA! AAA! AAA! AAA! AAA! AAA! AAA! AAA! AAA! AAA! AAA!";
 char const target_path1[] = "/f1";
 char const target_path2[] = "/f2";
 char const target_path3[] = "/f3";
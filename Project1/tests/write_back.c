@@ -0,0 +1,113 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MESSAGES 100
+#define MESSAGE_SIZE 16
+
+char const path1[] = "/f1";
+char const path2[] = "/f2";
+
+static unsigned long device_accesses(void) {
+    tfs_device_stats_t stats;
+    tfs_device_stats(&stats);
+    return stats.submitted;
+}
+
+static void message(char *buffer, int i) {
+    snprintf(buffer, MESSAGE_SIZE + 1, "message %06d\n", i);
+}
+
+static void assert_messages(int fhandle, int count) {
+    char expected[MESSAGE_SIZE + 1];
+    char buffer[MESSAGE_SIZE];
+    for (int i = 0; i < count; i++) {
+        message(expected, i);
+        assert(tfs_pread(fhandle, buffer, MESSAGE_SIZE,
+                         (size_t)i * MESSAGE_SIZE) == MESSAGE_SIZE);
+        assert(memcmp(buffer, expected, MESSAGE_SIZE) == 0);
+    }
+    assert(tfs_pread(fhandle, buffer, MESSAGE_SIZE,
+                     (size_t)count * MESSAGE_SIZE) == 0);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.device = tfs_device_params(TFS_DEVICE_NONE);
+    assert(tfs_init(&params) != -1);
+
+    // one message per write: the writes are only buffered, but can be read
+    int fhandle = tfs_open(path1, TFS_O_CREAT | TFS_O_APPEND);
+    assert(fhandle != -1);
+    unsigned long before = device_accesses();
+    char buffer[MESSAGE_SIZE + 1];
+    for (int i = 0; i < MESSAGES; i++) {
+        message(buffer, i);
+        assert(tfs_write(fhandle, buffer, MESSAGE_SIZE) == MESSAGE_SIZE);
+    }
+    assert(device_accesses() - before < MESSAGES / 10);
+    assert_messages(fhandle, MESSAGES);
+
+    // flushing writes them to the blocks
+    before = device_accesses();
+    assert(tfs_flush(fhandle) != -1);
+    assert(device_accesses() > before);
+    assert_messages(fhandle, MESSAGES);
+    assert(tfs_flush(-1) == -1);
+
+    // the flusher gets to them without being asked
+    message(buffer, MESSAGES);
+    assert(tfs_write(fhandle, buffer, MESSAGE_SIZE) == MESSAGE_SIZE);
+    before = device_accesses();
+    for (int i = 0; i < 200 && device_accesses() == before; i++) {
+        nanosleep(&(struct timespec){.tv_nsec = 10 * 1000 * 1000}, NULL);
+    }
+    assert(device_accesses() > before);
+    assert_messages(fhandle, MESSAGES + 1);
+
+    // and they stay there once the file is closed
+    assert(tfs_write(fhandle, buffer, 0) == 0);
+    message(buffer, MESSAGES + 1);
+    assert(tfs_write(fhandle, buffer, MESSAGE_SIZE) == MESSAGE_SIZE);
+    assert(tfs_close(fhandle) != -1);
+    fhandle = tfs_open(path1, 0);
+    assert(fhandle != -1);
+    assert_messages(fhandle, MESSAGES + 2);
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_destroy() != -1);
+
+    // buffered writes hold on to the blocks they will need, so running out
+    // of space is still reported by the write that does not fit (the writes
+    // are too long for the files to be kept in their inodes)
+    params.max_block_count = 2; // one for the root directory
+    assert(tfs_init(&params) != -1);
+    fhandle = tfs_open(path1, TFS_O_CREAT);
+    assert(fhandle != -1);
+    int fhandle2 = tfs_open(path2, TFS_O_CREAT);
+    assert(fhandle2 != -1);
+    char record[MESSAGES * MESSAGE_SIZE / 2];
+    for (int i = 0; i < MESSAGES / 2; i++) {
+        message(buffer, i);
+        memcpy(record + i * MESSAGE_SIZE, buffer, MESSAGE_SIZE);
+    }
+    assert(tfs_write(fhandle, record, sizeof(record)) == sizeof(record));
+    assert(tfs_write(fhandle2, record, sizeof(record)) == -1);
+    assert(tfs_close(fhandle2) != -1);
+    assert_messages(fhandle, MESSAGES / 2);
+    assert(tfs_close(fhandle) != -1);
+
+    // unlinking the file makes its block available again
+    assert(tfs_unlink(path1) != -1);
+    fhandle2 = tfs_open(path2, 0);
+    assert(fhandle2 != -1);
+    assert(tfs_write(fhandle2, record, sizeof(record)) == sizeof(record));
+    assert_messages(fhandle2, MESSAGES / 2);
+    assert(tfs_close(fhandle2) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}